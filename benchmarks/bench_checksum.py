@@ -0,0 +1,54 @@
+"""Checksum benchmark: cost of per-record CRC32C (checksum=True) on writing and reading.
+
+Files are written uncompressed (codec="none") and read into columns through mmap,
+the fastest paths, so compression and building dicts do not hide the overhead.
+Also prints raw pb.crc32c throughput.
+
+    $ python3 benchmarks/bench_checksum.py [--records N] [--apps N]
+"""
+import argparse
+import os
+import tempfile
+import time
+
+import pb
+from bench_write import make_records
+
+
+def best_of_interleaved(repeat, funcs):
+    """Best time of each of funcs, run in turn so that noise hits them alike."""
+    elapsed = [float("inf")] * len(funcs)
+    for _ in range(repeat):
+        for i, func in enumerate(funcs):
+            started = time.perf_counter()
+            func()
+            elapsed[i] = min(elapsed[i], time.perf_counter() - started)
+    return elapsed
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--records", type=int, default=200000)
+    parser.add_argument("--apps", type=int, default=50, help="max apps per record")
+    parser.add_argument("--repeat", type=int, default=5, help="best of N runs")
+    args = parser.parse_args()
+
+    records = make_records(args.records, args.apps)
+    block = bytes(range(256)) * 4096
+    crc, = best_of_interleaved(args.repeat, [lambda: pb.crc32c(block)])
+    print("crc32c: %.0f MB/s" % (len(block) / crc / 1e6))
+
+    fnames = [os.path.join(tempfile.gettempdir(), "bench_checksum%d.pb" % i) for i in range(2)]
+    write = best_of_interleaved(args.repeat, [
+        lambda: pb.deviceapps_xwrite_pb(records, fnames[0], codec="none"),
+        lambda: pb.deviceapps_xwrite_pb(records, fnames[1], codec="none", checksum=True)])
+    read = best_of_interleaved(args.repeat, [lambda: pb.deviceapps_xread_columns(fname) for fname in fnames])
+    print("%9s %12s %12s %10s" % ("checksum", "write ms", "read ms", "bytes"))
+    for i, checksum in enumerate((False, True)):
+        print("%9s %12.1f %12.1f %10d" % (checksum, write[i] * 1e3, read[i] * 1e3, os.path.getsize(fnames[i])))
+    print("overhead: write %+.1f%%, read %+.1f%%" % (100 * (write[1] / write[0] - 1), 100 * (read[1] / read[0] - 1)))
+    for fname in fnames:
+        os.remove(fname)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,45 @@
+"""Codec benchmark of pb.deviceapps_xwrite_pb(..., codec=C): write/read MB/s and compression ratio.
+
+MB/s are of uncompressed framed records. Reading goes through pb.deviceapps_xread_columns,
+so it measures decompression and parsing without building dicts.
+With zstd built in, "zstd+dict" compresses against a dictionary trained on the first records,
+which pays off for small blocks (--block-size).
+
+    $ python3 benchmarks/bench_codecs.py [--records N] [--apps N] [--threads N] [--block-size N]
+"""
+import argparse
+import os
+import tempfile
+
+import pb
+from bench_write import best_of, make_records
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--records", type=int, default=200000)
+    parser.add_argument("--apps", type=int, default=50, help="max apps per record")
+    parser.add_argument("--threads", type=int, default=1, help="compression threads")
+    parser.add_argument("--block-size", type=int, default=256 * 1024, help="uncompressed bytes per block")
+    parser.add_argument("--repeat", type=int, default=3, help="best of N runs")
+    args = parser.parse_args()
+
+    records = make_records(args.records, args.apps)
+    fname = os.path.join(tempfile.gettempdir(), "bench_codecs.pb")
+    runs = [(codec, codec, None) for codec in pb.codecs]
+    if "zstd" in pb.codecs:
+        runs.append(("zstd+dict", "zstd", pb.deviceapps_train_dictionary(records[:10000])))
+    print("%9s %10s %10s %8s %12s" % ("codec", "write MB/s", "read MB/s", "ratio", "file bytes"))
+    for name, codec, dictionary in runs:
+        kwargs = {"dictionary": dictionary} if dictionary else {}
+        write_kwargs = dict(kwargs, codec=codec, threads=args.threads, block_size=args.block_size)
+        size = pb.deviceapps_xwrite_pb(records, fname, **write_kwargs)
+        write = best_of(args.repeat, lambda: pb.deviceapps_xwrite_pb(records, fname, **write_kwargs))
+        read = best_of(args.repeat, lambda: pb.deviceapps_xread_columns(fname, **kwargs))
+        file_size = os.path.getsize(fname)
+        print("%9s %10.1f %10.1f %8.2f %12d" % (name, size / write / 1e6, size / read / 1e6, size / file_size, file_size))
+    os.remove(fname)
+
+
+if __name__ == "__main__":
+    main()
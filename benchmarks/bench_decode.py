@@ -0,0 +1,39 @@
+"""Decode benchmark: records/s of building dicts from framed records.
+
+pb.deviceapps_decode parses an in-memory stream, so the time is almost all dict building
+(keys, device strings, apps lists, floats). pb.deviceapps_xread_pb reads the same records
+from an uncompressed (mapped) file lazily, one dict per next(). Few apps per record (--apps)
+leave more of the time to the per-record fields.
+
+    $ python3 benchmarks/bench_decode.py [--records N] [--apps N]
+"""
+import argparse
+import os
+import tempfile
+
+import pb
+from bench_write import best_of, make_records
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--records", type=int, default=200000)
+    parser.add_argument("--apps", type=int, default=50, help="max apps per record")
+    parser.add_argument("--repeat", type=int, default=5, help="best of N runs")
+    args = parser.parse_args()
+
+    data = pb.deviceapps_encode(make_records(args.records, args.apps))
+    fname = os.path.join(tempfile.gettempdir(), "bench_decode.pb")
+    pb.deviceapps_xwrite_pb(pb.deviceapps_decode(data), fname, codec="none")
+    timings = [
+        ("decode", best_of(args.repeat, lambda: pb.deviceapps_decode(data))),
+        ("xread_pb", best_of(args.repeat, lambda: sum(1 for _ in pb.deviceapps_xread_pb(fname)))),
+    ]
+    print("%10s %12s %10s" % ("", "records/s", "MB/s"))
+    for name, elapsed in timings:
+        print("%10s %12.0f %10.1f" % (name, args.records / elapsed, len(data) / elapsed / 1e6))
+    os.remove(fname)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,39 @@
+"""Encode benchmark: records/s of serializing dicts with apps given as list, tuple or array('I').
+
+pb.deviceapps_encode works in memory, so the time is all spent on looking up dict keys,
+converting strings and floats and copying apps. Few apps per record (--apps) leave more of
+the time to the per-record fields.
+
+    $ python3 benchmarks/bench_encode.py [--records N] [--apps N]
+"""
+import argparse
+import array
+
+import pb
+from bench_write import best_of, make_records
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--records", type=int, default=200000)
+    parser.add_argument("--apps", type=int, default=50, help="max apps per record")
+    parser.add_argument("--repeat", type=int, default=5, help="best of N runs")
+    args = parser.parse_args()
+
+    records = make_records(args.records, args.apps)
+    print("%12s %12s %10s" % ("apps", "records/s", "MB/s"))
+    for name, convert in (("list", list), ("tuple", tuple), ("array", lambda apps: array.array("I", apps))):
+        converted = [dict(record, apps=convert(record["apps"])) for record in records]
+        for packed in (False, True):
+            label = name + (" packed" if packed else "")
+            try:
+                size = len(pb.deviceapps_encode(converted, packed=packed))
+            except TypeError:
+                print("%12s %12s" % (label, "unsupported"))
+                continue
+            elapsed = best_of(args.repeat, lambda: pb.deviceapps_encode(converted, packed=packed))
+            print("%12s %12.0f %10.1f" % (label, args.records / elapsed, size / elapsed / 1e6))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,50 @@
+"""Sharded writing: pb.deviceapps_xwrite_sharded against splitting in Python and a deviceapps_xwrite_pb per shard.
+
+The baseline routes records by pb.crc32c of device.id, as the sharded writer does, into lists and
+writes every list with deviceapps_xwrite_pb (gzwrite on the calling thread). The sharded writer
+serializes all records on the calling thread (with the GIL, serially for all shards) and compresses
+every shard on its own thread, so only compression runs in parallel: that pays off with several cores
+as far as compression outweighs serialization.
+
+    $ python3 benchmarks/bench_sharded.py [--records N] [--apps N] [--shards N]
+"""
+import argparse
+import os
+import tempfile
+
+import pb
+from bench_write import best_of, make_records
+
+
+def split_and_write(records, template, shards):
+    lists = [[] for _ in range(shards)]
+    for record in records:
+        lists[pb.crc32c(record["device"]["id"].encode()) % shards].append(record)
+    return [(len(shard), pb.deviceapps_xwrite_pb(shard, template.format(i))) for i, shard in enumerate(lists)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--records", type=int, default=200000)
+    parser.add_argument("--apps", type=int, default=50, help="max apps per record")
+    parser.add_argument("--shards", type=int, default=os.cpu_count() or 1)
+    parser.add_argument("--repeat", type=int, default=3, help="best of N runs")
+    args = parser.parse_args()
+
+    records = make_records(args.records, args.apps)
+    template = os.path.join(tempfile.gettempdir(), "bench_sharded{}.pb.gz")
+    assert split_and_write(records, template, args.shards) == pb.deviceapps_xwrite_sharded(records, template, args.shards)
+    timings = [
+        ("split+xwrite_pb", best_of(args.repeat, lambda: split_and_write(records, template, args.shards))),
+        ("xwrite_sharded", best_of(args.repeat, lambda: pb.deviceapps_xwrite_sharded(records, template, args.shards))),
+    ]
+    print("%d shards, %d cores" % (args.shards, os.cpu_count() or 1))
+    print("%16s %12s %8s" % ("", "records/s", "speedup"))
+    for name, elapsed in timings:
+        print("%16s %12.0f %7.2fx" % (name, args.records / elapsed, timings[0][1] / elapsed))
+    for i in range(args.shards):
+        os.remove(template.format(i))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,238 @@
+"""Benchmark suite: pb.deviceapps_xwrite_pb / deviceapps_xread_pb against pure-Python deviceapps_pb2.
+
+Every case (implementation, operation, codec) runs in its own process on a synthetic corpus
+(see corpus.py for its options), so that peak RSS and heap allocations are its own:
+    records/s, raw MB/s     of framed (uncompressed) records
+    compressed MB/s         of the file as written or read
+    peak RSS                of the process, and how much the operation added to it
+    mallocs/record          C heap allocations (LD_PRELOAD shim of bench_write.py);
+                            pymalloc serves small Python objects itself, so they are not counted
+The "python" implementation frames deviceapps_pb2 messages with struct and gzip modules, reading
+gives dicts as pb does; it supports gzip and none codecs. Python protobuf is forced to its pure
+Python backend unless PROTOCOL_BUFFERS_PYTHON_IMPLEMENTATION says otherwise.
+
+--json writes results with the corpus and environment for tracking over time,
+--baseline compares records/s with such a file of an earlier run.
+
+    $ python3 benchmarks/bench_suite.py [--records N] [--apps DIST] [--codecs C,C] [--json FILE] [--baseline FILE]
+"""
+import argparse
+import gc
+import gzip
+import json
+import os
+import platform
+import resource
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+os.environ.setdefault("PROTOCOL_BUFFERS_PYTHON_IMPLEMENTATION", "python")
+sys.path.append(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))  # deviceapps_pb2 of the repo
+
+import deviceapps_pb2
+import pb
+from bench_write import build_malloc_counter, malloc_count
+from corpus import add_arguments, corpus_argv, corpus_params, make_corpus
+
+MAGIC = 0xFFFFFFFF
+DEVICE_APPS_TYPE = 1
+PBHEADER_WIDE = 0x8000
+PYTHON_CODECS = ("gzip", "none")
+
+
+def open_file(fname, mode, codec):
+    return gzip.open(fname, mode, compresslevel=6) if codec == "gzip" else open(fname, mode)
+
+
+def python_write(records, fname, codec):
+    """deviceapps_xwrite_pb by deviceapps_pb2: return number of written (uncompressed) bytes."""
+    size = 0
+    with open_file(fname, "wb", codec) as f:
+        for record in records:
+            message = deviceapps_pb2.DeviceApps()
+            device = record.get("device")
+            if device is not None:
+                message.device.SetInParent()
+                if "id" in device:
+                    message.device.id = device["id"].encode()
+                if "type" in device:
+                    message.device.type = device["type"].encode()
+            message.apps.extend(record.get("apps", ()))
+            if "lat" in record:
+                message.lat = record["lat"]
+            if "lon" in record:
+                message.lon = record["lon"]
+            data = message.SerializeToString()
+            if len(data) > 0xFFFF:
+                header = struct.pack("<IHHI", MAGIC, DEVICE_APPS_TYPE | PBHEADER_WIDE, 0, len(data))
+            else:
+                header = struct.pack("<IHH", MAGIC, DEVICE_APPS_TYPE, len(data))
+            f.write(header)
+            f.write(data)
+            size += len(header) + len(data)
+    return size
+
+
+def python_read(fname, codec):
+    """deviceapps_xread_pb by deviceapps_pb2: generate dicts of DeviceApps records."""
+    with open_file(fname, "rb", codec) as f:
+        while True:
+            header = f.read(8)
+            if not header:
+                return
+            magic, record_type, length = struct.unpack("<IHH", header)
+            if magic != MAGIC:
+                raise ValueError("Bad magic.")
+            if record_type & PBHEADER_WIDE:
+                length, = struct.unpack("<I", f.read(4))
+            message = deviceapps_pb2.DeviceApps()
+            message.ParseFromString(f.read(length))
+            record = {}
+            if message.HasField("device"):
+                device = record["device"] = {}
+                if message.device.HasField("id"):
+                    device["id"] = message.device.id.decode()
+                if message.device.HasField("type"):
+                    device["type"] = message.device.type.decode()
+            if message.HasField("lat"):
+                record["lat"] = message.lat
+            if message.HasField("lon"):
+                record["lon"] = message.lon
+            record["apps"] = list(message.apps)
+            yield record
+
+
+def peak_rss_kb():
+    return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+
+
+def run_case(args):
+    """Run one case in this process, return its result dict."""
+    impl, op, codec = args.case.split(":")
+    fname = args.input
+    if op == "write":
+        records = make_corpus(**corpus_params(args))
+        fname = os.path.join(tempfile.gettempdir(), "bench_suite_%d.pb" % os.getpid())
+        if impl == "pb":
+            func = lambda: pb.deviceapps_xwrite_pb(records, fname, codec=codec)
+        else:
+            func = lambda: python_write(records, fname, codec)
+    else:
+        if impl == "pb":
+            func = lambda: sum(1 for _ in pb.deviceapps_xread_pb(fname))
+        else:
+            func = lambda: sum(1 for _ in python_read(fname, codec))
+    gc.collect()
+    rss_before = peak_rss_kb()
+    mallocs = malloc_count()
+    started = time.perf_counter()
+    result = func()
+    elapsed = time.perf_counter() - started
+    mallocs = None if mallocs is None else malloc_count() - mallocs
+    rss_after = peak_rss_kb()
+    for _ in range(args.repeat - 1):
+        started = time.perf_counter()
+        func()
+        elapsed = min(elapsed, time.perf_counter() - started)
+
+    compressed_bytes = os.path.getsize(fname)
+    if op == "write":
+        n_records, raw_bytes = len(records), result
+        os.remove(fname)
+    else:
+        n_records, raw_bytes = result, args.raw_bytes
+    return {"impl": impl, "op": op, "codec": codec, "records": n_records, "seconds": elapsed,
+            "records_per_s": n_records / elapsed, "raw_bytes": raw_bytes, "raw_mb_per_s": raw_bytes / elapsed / 1e6,
+            "compressed_bytes": compressed_bytes, "compressed_mb_per_s": compressed_bytes / elapsed / 1e6,
+            "peak_rss_kb": rss_after, "rss_growth_kb": rss_after - rss_before,
+            "mallocs_per_record": None if mallocs is None else mallocs / float(n_records)}
+
+
+def spawn_case(case, args, params, fname, raw_bytes, env):
+    argv = [sys.executable, os.path.abspath(__file__), "--case", case, "--input", fname,
+            "--raw-bytes", str(raw_bytes), "--repeat", str(args.repeat)] + corpus_argv(params)
+    return json.loads(subprocess.check_output(argv, env=env))
+
+
+def environment():
+    from google.protobuf import __version__ as protobuf_version
+    from google.protobuf.internal import api_implementation
+    return {"time": time.strftime("%Y-%m-%dT%H:%M:%S%z"), "python": platform.python_version(),
+            "platform": platform.platform(), "machine": platform.machine(), "cpus": os.cpu_count(),
+            "protobuf": protobuf_version, "protobuf_backend": api_implementation.Type(), "codecs": list(pb.codecs),
+            "pb_stats": hasattr(pb, "stats")}  # instrumented build (-DPB_STATS) is slower
+
+
+def print_results(results, baseline, out):
+    by_case = {(r["impl"], r["op"], r["codec"]): r for r in results}
+    old = {(r["impl"], r["op"], r["codec"]): r for r in baseline["results"]} if baseline else {}
+    print("%6s %5s %5s %11s %9s %9s %9s %9s %10s %8s %9s" % (
+        "impl", "op", "codec", "records/s", "raw MB/s", "file MB/s", "peak MB", "+RSS MB", "mallocs/r", "vs py",
+        "vs base" if baseline else ""), file=out)
+    for r in results:
+        key = (r["impl"], r["op"], r["codec"])
+        python = by_case.get(("python",) + key[1:])
+        mallocs = "-" if r["mallocs_per_record"] is None else "%.3f" % r["mallocs_per_record"]
+        speedup = "%.1fx" % (r["records_per_s"] / python["records_per_s"]) if python and r is not python else ""
+        change = "%+.1f%%" % (100 * (r["records_per_s"] / old[key]["records_per_s"] - 1)) if key in old else ""
+        print("%6s %5s %5s %11.0f %9.1f %9.1f %9.1f %9.1f %10s %8s %9s" % (
+            r["impl"], r["op"], r["codec"], r["records_per_s"], r["raw_mb_per_s"], r["compressed_mb_per_s"],
+            r["peak_rss_kb"] / 1024.0, r["rss_growth_kb"] / 1024.0, mallocs, speedup, change), file=out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--codecs", default=",".join(PYTHON_CODECS),
+                        help="comma separated codecs of pb (default: %(default)s), python runs gzip and none")
+    parser.add_argument("--no-python", action="store_true", help="skip deviceapps_pb2 cases")
+    parser.add_argument("--no-malloc-count", action="store_true")
+    parser.add_argument("--repeat", type=int, default=3, help="best of N runs")
+    parser.add_argument("--json", metavar="FILE", help="write results as JSON to FILE ('-' for stdout)")
+    parser.add_argument("--baseline", metavar="FILE", help="compare records/s with JSON results of an earlier run")
+    parser.add_argument("--case", help=argparse.SUPPRESS)  # IMPL:OP:CODEC of a child process
+    parser.add_argument("--input", help=argparse.SUPPRESS)
+    parser.add_argument("--raw-bytes", type=int, help=argparse.SUPPRESS)
+    add_arguments(parser)
+    args = parser.parse_args()
+    if args.case:
+        json.dump(run_case(args), sys.stdout)
+        return
+
+    baseline = None
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        if baseline["corpus"] != corpus_params(args):
+            print("warning: baseline corpus differs: %s" % json.dumps(baseline["corpus"]), file=sys.stderr)
+    env = dict(os.environ)
+    lib = None if args.no_malloc_count else build_malloc_counter()
+    if lib:
+        env["LD_PRELOAD"] = lib
+    params = corpus_params(args)
+    records = make_corpus(**params)
+    results = []
+    for codec in args.codecs.split(","):
+        # readers of every implementation take the same file written by pb
+        fname = os.path.join(tempfile.gettempdir(), "bench_suite_%s.pb" % codec)
+        raw_bytes = pb.deviceapps_xwrite_pb(records, fname, codec=codec)
+        impls = ["pb"] + (["python"] if codec in PYTHON_CODECS and not args.no_python else [])
+        for op in ("write", "read"):
+            for impl in impls:
+                results.append(spawn_case("%s:%s:%s" % (impl, op, codec), args, params, fname, raw_bytes, env))
+        os.remove(fname)
+
+    print_results(results, baseline, sys.stderr if args.json == "-" else sys.stdout)
+    if args.json:
+        report = {"environment": environment(), "corpus": params, "repeat": args.repeat, "results": results}
+        if args.json == "-":
+            json.dump(report, sys.stdout, indent=2)
+        else:
+            with open(args.json, "w") as f:
+                json.dump(report, f, indent=2)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,42 @@
+"""Scaling benchmark of pb.deviceapps_xwrite_pb(..., threads=N): records/s and speedup for 1..N threads.
+
+threads=1 is the single-stream gzwrite writer, threads > 1 the parallel block compressor.
+
+    $ python3 benchmarks/bench_threads.py [--records N] [--apps N] [--max-threads N]
+"""
+import argparse
+import os
+import tempfile
+import time
+
+import pb
+from bench_write import make_records
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--records", type=int, default=200000)
+    parser.add_argument("--apps", type=int, default=50, help="max apps per record")
+    parser.add_argument("--max-threads", type=int, default=os.cpu_count() or 1)
+    parser.add_argument("--repeat", type=int, default=3, help="best of N runs")
+    args = parser.parse_args()
+
+    records = make_records(args.records, args.apps)
+    fname = os.path.join(tempfile.gettempdir(), "bench_threads.pb.gz")
+    threads, base = 1, None
+    print("%7s %12s %8s %12s" % ("threads", "records/s", "speedup", "file bytes"))
+    while threads <= args.max_threads:
+        elapsed = float("inf")
+        for _ in range(args.repeat):
+            started = time.perf_counter()
+            pb.deviceapps_xwrite_pb(records, fname, threads=threads)
+            elapsed = min(elapsed, time.perf_counter() - started)
+        rate = args.records / elapsed
+        base = base or rate
+        print("%7d %12.0f %7.2fx %12d" % (threads, rate, rate / base, os.path.getsize(fname)))
+        threads = threads + 1 if threads < 4 else threads * 2
+    os.remove(fname)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,109 @@
+"""Benchmark of pb.deviceapps_xwrite_pb: records/s and heap allocations per record.
+
+Allocations are counted by an LD_PRELOAD shim (compiled on the fly with cc) that
+wraps glibc malloc/calloc/realloc; pymalloc serves small Python objects itself,
+so the counter reflects the C heap traffic of the serializer.
+
+    $ python3 benchmarks/bench_write.py [--records N] [--apps N]
+"""
+import argparse
+import ctypes
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+import pb
+from corpus import make_corpus
+
+MALLOC_COUNTER_SRC = r"""
+#include <stddef.h>
+extern void* __libc_malloc(size_t);
+extern void* __libc_calloc(size_t, size_t);
+extern void* __libc_realloc(void*, size_t);
+unsigned long pb_bench_mallocs = 0;
+void* malloc(size_t n) { __atomic_add_fetch(&pb_bench_mallocs, 1, __ATOMIC_RELAXED); return __libc_malloc(n); }
+void* calloc(size_t c, size_t n) { __atomic_add_fetch(&pb_bench_mallocs, 1, __ATOMIC_RELAXED); return __libc_calloc(c, n); }
+void* realloc(void* p, size_t n) { __atomic_add_fetch(&pb_bench_mallocs, 1, __ATOMIC_RELAXED); return __libc_realloc(p, n); }
+"""
+PRELOAD_ENV = "PB_BENCH_PRELOADED"
+
+
+def build_malloc_counter():
+    """Compile the malloc counter shim, return path of the shared library or None if not possible."""
+    tmpdir = tempfile.mkdtemp(prefix="pb_bench_")
+    src, lib = os.path.join(tmpdir, "counter.c"), os.path.join(tmpdir, "counter.so")
+    with open(src, "w") as f:
+        f.write(MALLOC_COUNTER_SRC)
+    if subprocess.call(["cc", "-O2", "-shared", "-fPIC", src, "-o", lib]) != 0:
+        return None
+    return lib
+
+
+def preload_malloc_counter():
+    """Re-exec this script with the malloc counter preloaded, return False if not possible."""
+    if os.environ.get(PRELOAD_ENV):
+        return True
+    lib = build_malloc_counter()
+    if lib is None:
+        return False
+    env = dict(os.environ, LD_PRELOAD=lib, **{PRELOAD_ENV: "1"})
+    os.execve(sys.executable, [sys.executable] + sys.argv, env)
+
+
+def malloc_count():
+    try:
+        return ctypes.c_ulong.in_dll(ctypes.CDLL(None), "pb_bench_mallocs").value
+    except ValueError:
+        return None
+
+
+def best_of(repeat, func):
+    """Best time of repeat runs of func (in seconds)."""
+    elapsed = float("inf")
+    for _ in range(repeat):
+        started = time.perf_counter()
+        func()
+        elapsed = min(elapsed, time.perf_counter() - started)
+    return elapsed
+
+
+def make_records(n, apps):
+    """Corpus of the standalone benchmarks: n records of 1..apps apps (see corpus.make_corpus)."""
+    return make_corpus(n, apps="uniform:1:%d" % apps)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--records", type=int, default=200000)
+    parser.add_argument("--apps", type=int, default=50, help="max apps per record")
+    parser.add_argument("--no-malloc-count", action="store_true")
+    args = parser.parse_args()
+    if not args.no_malloc_count:
+        preload_malloc_counter()
+
+    records = make_records(args.records, args.apps)
+    fname = os.path.join(tempfile.gettempdir(), "bench_write.pb.gz")
+    pb.deviceapps_xwrite_pb(records[:1000], fname)  # warm up
+    # steady state: per-record cost is the slope between a short and a long run
+    runs = []
+    for n in (args.records // 10, args.records):
+        mallocs = malloc_count()
+        started = time.perf_counter()
+        pb.deviceapps_xwrite_pb(records[:n], fname)
+        elapsed = time.perf_counter() - started
+        mallocs = None if mallocs is None else malloc_count() - mallocs
+        runs.append((n, elapsed, mallocs))
+    os.remove(fname)
+
+    (n1, _, m1), (n2, elapsed, m2) = runs
+    print("records:            %d" % n2)
+    print("records/s:          %.0f" % (n2 / elapsed))
+    if m2 is not None:
+        print("mallocs per call:   %d" % m2)
+        print("mallocs per record: %.4f" % ((m2 - m1) / float(n2 - n1)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,111 @@
+"""Synthetic DeviceApps corpus: reproducible records with configurable shape.
+
+The shape of records is what moves the numbers: long app lists favour packed records and
+compress well, unique device ids do not, a few device types end up as shared strings.
+    --apps DIST         number of apps per record: fixed:N, uniform:LO:HI or geometric:MEAN
+    --app-ids N         app ids are drawn from 1..N
+    --devices N         device ids are drawn from a pool of N ids, 0 makes every id unique
+    --device-types N    number of distinct device types
+    --geo FRACTION      share of records with lat/lon
+The same arguments and --seed give the same records on every run. The standalone benchmarks
+take their records from here as well (bench_write.make_records), so they measure the same data.
+
+    $ python3 benchmarks/corpus.py out.pb.gz [--records N] [--apps DIST] [--codec C] ...
+"""
+import argparse
+import math
+import os
+import random
+import time
+
+import pb
+
+DEVICE_TYPES = ("idfa", "gaid", "adid", "openudid")
+
+
+def parse_distribution(spec):
+    """Return function(rnd) -> int drawing app list lengths by spec (see module doc)."""
+    name, _, params = spec.partition(":")
+    try:
+        values = [float(value) for value in params.split(":")] if params else []
+    except ValueError:
+        values = []
+    if name == "fixed" and len(values) == 1 and values[0] >= 0:
+        count = int(values[0])
+        return lambda rnd: count
+    if name == "uniform" and len(values) == 2 and 0 <= values[0] <= values[1]:
+        low, high = int(values[0]), int(values[1])
+        return lambda rnd: rnd.randint(low, high)
+    if name == "geometric" and len(values) == 1 and values[0] > 0:
+        # failures before the first success with p = 1 / (mean + 1), by inversion of exponential
+        scale = -1.0 / math.log1p(-1.0 / (values[0] + 1))
+        return lambda rnd: int(rnd.expovariate(1.0) * scale)
+    raise ValueError("bad distribution %r, expected fixed:N, uniform:LO:HI or geometric:MEAN" % spec)
+
+
+def distribution(spec):
+    """argparse type of --apps: spec string checked by parse_distribution."""
+    try:
+        parse_distribution(spec)
+    except ValueError as e:
+        raise argparse.ArgumentTypeError(str(e))
+    return spec
+
+
+def make_corpus(records, apps="uniform:1:50", app_ids=100000, devices=0, device_types=3, geo=1.0, seed=42):
+    """Return list of DeviceApps dicts as pb.deviceapps_xwrite_pb takes them."""
+    rnd = random.Random(seed)
+    n_apps = parse_distribution(apps)
+    types = [DEVICE_TYPES[i] if i < len(DEVICE_TYPES) else "type%d" % i for i in range(max(device_types, 1))]
+    pool = ["%032x" % rnd.getrandbits(128) for _ in range(devices)]
+    corpus = []
+    for _ in range(records):
+        record = {"device": {"type": rnd.choice(types),
+                             "id": rnd.choice(pool) if pool else "%032x" % rnd.getrandbits(128)}}
+        if rnd.random() < geo:
+            record["lat"] = rnd.uniform(-90, 90)
+            record["lon"] = rnd.uniform(-180, 180)
+        record["apps"] = [rnd.randint(1, app_ids) for _ in range(n_apps(rnd))]
+        corpus.append(record)
+    return corpus
+
+
+def add_arguments(parser):
+    """Add corpus options to parser, corpus_params picks them from parsed args."""
+    group = parser.add_argument_group("corpus")
+    group.add_argument("--records", type=int, default=200000)
+    group.add_argument("--apps", type=distribution, default="uniform:1:50", metavar="DIST",
+                       help="apps per record: fixed:N, uniform:LO:HI or geometric:MEAN (default: %(default)s)")
+    group.add_argument("--app-ids", type=int, default=100000, help="app ids are drawn from 1..N")
+    group.add_argument("--devices", type=int, default=0, help="pool of device ids, 0 for unique ids")
+    group.add_argument("--device-types", type=int, default=3, help="number of device types")
+    group.add_argument("--geo", type=float, default=1.0, help="share of records with lat/lon")
+    group.add_argument("--seed", type=int, default=42)
+
+
+def corpus_params(args):
+    """Keyword arguments of make_corpus from args parsed with add_arguments."""
+    return {"records": args.records, "apps": args.apps, "app_ids": args.app_ids, "devices": args.devices,
+            "device_types": args.device_types, "geo": args.geo, "seed": args.seed}
+
+
+def corpus_argv(params):
+    """Command line options giving params back (for benchmarks run in subprocesses)."""
+    return ["--%s=%s" % (name.replace("_", "-"), value) for name, value in params.items()]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("fname")
+    parser.add_argument("--codec", default="gzip", help="codec of pb.deviceapps_xwrite_pb (default: %(default)s)")
+    add_arguments(parser)
+    args = parser.parse_args()
+    started = time.perf_counter()
+    records = make_corpus(**corpus_params(args))
+    size = pb.deviceapps_xwrite_pb(records, args.fname, codec=args.codec)
+    print("%d records, %d bytes framed, %d bytes in %s (%.1fs)" % (
+        len(records), size, os.path.getsize(args.fname), args.fname, time.perf_counter() - started))
+
+
+if __name__ == "__main__":
+    main()
@@ -1,12 +1,38 @@
 #define PY_SSIZE_T_CLEAN  # https://docs.python.org/3.9/c-api/intro.html
 #include <Python.h>
+#include <structmember.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <zlib.h>
+#ifdef PB_STATS
+#include <time.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
 
 #include "deviceapps.pb-c.h"
 
 #define MAGIC  0xFFFFFFFF
 #define DEVICE_APPS_TYPE 1
+// Same DeviceApps message, but apps are written as one packed field (tag 2, length-delimited varints)
+// instead of a tag per app. Any proto2 parser accepts both encodings of a repeated scalar field.
+#define DEVICE_APPS_PACKED_TYPE 2
 #define PBHEADER_INIT {MAGIC, 0, 0}
 
 typedef struct pbheader_s {
@@ -15,7 +41,513 @@ typedef struct pbheader_s {
     uint16_t length;
 } pbheader_t;
 
-size_t device_apps_serialize(PyObject* py_item, gzFile zfile) {
+// Records of messages over UINT16_MAX bytes (every record with wide=True of writers) get a wide header:
+// pbheader_t with PBHEADER_WIDE bit set in type and length 0, followed by uint32_t length of message.
+// Records of writers with checksum=True have PBHEADER_CRC bit set in type and uint32_t CRC32C
+// of message at the end of header. Readers verify checksums of records that have them.
+#define PBHEADER_WIDE 0x8000
+#define PBHEADER_CRC 0x4000
+#define PBHEADER_MAX_SIZE (sizeof(pbheader_t) + 2 * sizeof(uint32_t))
+
+// CRC32C (Castagnoli), as of iSCSI and ext4: crc32 instruction of SSE4.2 (chosen at runtime by
+// pbcrc32c_init) or of ARMv8 CRC extension (if compiled for it), slicing-by-8 tables otherwise.
+// Takes crc of preceding data (0 for none).
+static uint32_t pbcrc32c_table[8][256];
+
+static uint32_t pbcrc32c_sw(uint32_t crc, const uint8_t* data, size_t size) {
+    crc = ~crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, data, sizeof(uint32_t));
+        memcpy(&hi, data + 4, sizeof(uint32_t));
+        lo ^= crc;
+        crc = pbcrc32c_table[7][lo & 0xff] ^ pbcrc32c_table[6][(lo >> 8) & 0xff]
+            ^ pbcrc32c_table[5][(lo >> 16) & 0xff] ^ pbcrc32c_table[4][lo >> 24]
+            ^ pbcrc32c_table[3][hi & 0xff] ^ pbcrc32c_table[2][(hi >> 8) & 0xff]
+            ^ pbcrc32c_table[1][(hi >> 16) & 0xff] ^ pbcrc32c_table[0][hi >> 24];
+    }
+    for (; size; data++, size--)
+        crc = pbcrc32c_table[0][(crc ^ *data) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t pbcrc32c_hw(uint32_t crc, const uint8_t* data, size_t size) {
+    uint64_t crc64 = ~crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(uint64_t));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    uint32_t crc32 = crc64;
+    if (size & 4) {
+        uint32_t word;
+        memcpy(&word, data, sizeof(uint32_t));
+        crc32 = _mm_crc32_u32(crc32, word);
+        data += 4;
+    }
+    if (size & 2) {
+        uint16_t word;
+        memcpy(&word, data, sizeof(uint16_t));
+        crc32 = _mm_crc32_u16(crc32, word);
+        data += 2;
+    }
+    if (size & 1)
+        crc32 = _mm_crc32_u8(crc32, *data);
+    return ~crc32;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t pbcrc32c_hw(uint32_t crc, const uint8_t* data, size_t size) {
+    crc = ~crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(uint64_t));
+        crc = __crc32cd(crc, word);
+    }
+    if (size & 4) {
+        uint32_t word;
+        memcpy(&word, data, sizeof(uint32_t));
+        crc = __crc32cw(crc, word);
+        data += 4;
+    }
+    if (size & 2) {
+        uint16_t word;
+        memcpy(&word, data, sizeof(uint16_t));
+        crc = __crc32ch(crc, word);
+        data += 2;
+    }
+    if (size & 1)
+        crc = __crc32cb(crc, *data);
+    return ~crc;
+}
+#endif
+
+static uint32_t (*pbcrc32c)(uint32_t crc, const uint8_t* data, size_t size) = pbcrc32c_sw;
+
+// Fill tables and pick implementation, called once on module import.
+static void pbcrc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        pbcrc32c_table[0][i] = crc;
+    }
+    for (int k = 1; k < 8; k++)
+        for (int i = 0; i < 256; i++)
+            pbcrc32c_table[k][i] = (pbcrc32c_table[k - 1][i] >> 8) ^ pbcrc32c_table[0][pbcrc32c_table[k - 1][i] & 0xff];
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        pbcrc32c = pbcrc32c_hw;
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    pbcrc32c = pbcrc32c_hw;
+#endif
+}
+
+// Parse header of record at data (size bytes available), put length of message to *length.
+// Return size of header, 0 if it is incomplete or -1 on wrong magic.
+static inline Py_ssize_t pbheader_get(const uint8_t* data, size_t size, size_t* length) {
+    pbheader_t pbheader;
+    if (size < sizeof(pbheader_t))
+        return 0;
+    memcpy(&pbheader, data, sizeof(pbheader_t));
+    if (pbheader.magic != MAGIC)
+        return -1;
+    size_t header_size = sizeof(pbheader_t) + (pbheader.type & PBHEADER_WIDE ? sizeof(uint32_t) : 0)
+        + (pbheader.type & PBHEADER_CRC ? sizeof(uint32_t) : 0);
+    if (size < header_size)
+        return 0;
+    if (pbheader.type & PBHEADER_WIDE) {
+        uint32_t wide_length;
+        memcpy(&wide_length, data + sizeof(pbheader_t), sizeof(uint32_t));
+        *length = wide_length;
+    } else {
+        *length = pbheader.length;
+    }
+    return header_size;
+}
+
+// Return 1 if record at data (with header of header_size and message of length bytes) has no checksum
+// or its checksum matches, 0 otherwise.
+static inline int pbheader_check(const uint8_t* data, size_t header_size, size_t length) {
+    pbheader_t pbheader;
+    memcpy(&pbheader, data, sizeof(pbheader_t));
+    if (!(pbheader.type & PBHEADER_CRC))
+        return 1;
+    uint32_t crc;
+    memcpy(&crc, data + header_size - sizeof(uint32_t), sizeof(uint32_t));
+    return crc == pbcrc32c(0, data + header_size, length);
+}
+
+// Return 1 if header at data has checksum (PBHEADER_CRC)
+static inline int pbheader_has_crc(const uint8_t* data) {
+    pbheader_t pbheader;
+    memcpy(&pbheader, data, sizeof(pbheader_t));
+    return (pbheader.type & PBHEADER_CRC) != 0;
+}
+
+// Record type of header at data, without flag bits
+static inline uint16_t pbheader_type(const uint8_t* data) {
+    pbheader_t pbheader;
+    memcpy(&pbheader, data, sizeof(pbheader_t));
+    return pbheader.type & ~(PBHEADER_WIDE | PBHEADER_CRC);
+}
+
+static inline int is_device_apps_type(uint16_t type) {
+    return type == DEVICE_APPS_TYPE || type == DEVICE_APPS_PACKED_TYPE;
+}
+
+// Set of record types wanted by a reader (deviceapps_xread_pb(types=)), a bit per type.
+// Records of other types are skipped by their headers: their messages are neither checked nor parsed.
+// NULL stands for DeviceApps types, which are the only ones readers decode.
+#define PBTYPE_MAX (PBHEADER_CRC - 1)
+
+typedef struct pbtypes_s {
+    uint8_t bits[(PBTYPE_MAX + 1) / 8];
+} pbtypes_t;
+
+static inline int pbtypes_has(const pbtypes_t* types, uint16_t type) {
+    if (!types)
+        return is_device_apps_type(type);
+    return types->bits[type / 8] >> (type % 8) & 1;
+}
+
+// Growable scratch buffer reused across records.
+// It is only grown (to the largest size requested so far) and released once by the owner,
+// so in the steady state (de)serialization does no heap allocations per record.
+typedef struct pbscratch_s {
+    void* data;
+    size_t size;
+} pbscratch_t;
+
+#define PBSCRATCH_INIT {NULL, 0}
+
+// Return buffer of at least size bytes (previous content is not preserved) or NULL on memory error.
+static void* pbscratch_reserve(pbscratch_t* scratch, size_t size) {
+    if (size <= scratch->size)
+        return scratch->data;
+    size_t new_size = scratch->size ? scratch->size : 256;
+    while (new_size < size)
+        new_size *= 2;
+    void* data = realloc(scratch->data, new_size);
+    if (!data)
+        return NULL;
+    scratch->data = data;
+    scratch->size = new_size;
+    return data;
+}
+
+static void pbscratch_free(pbscratch_t* scratch) {
+    free(scratch->data);
+    scratch->data = NULL;
+    scratch->size = 0;
+}
+
+// Scratch buffers of serializer: output record (pbheader_t + packed DeviceApps), batch of records
+// and, for the protobuf-c reference encoder, unpacked apps and its output record
+typedef struct serialize_scratch_s {
+    pbscratch_t record;
+    pbscratch_t batch;
+    pbscratch_t apps;
+    pbscratch_t reference;
+} serialize_scratch_t;
+
+#define SERIALIZE_SCRATCH_INIT {PBSCRATCH_INIT, PBSCRATCH_INIT, PBSCRATCH_INIT, PBSCRATCH_INIT}
+
+static void serialize_scratch_free(serialize_scratch_t* scratch) {
+    pbscratch_free(&scratch->record);
+    pbscratch_free(&scratch->batch);
+    pbscratch_free(&scratch->apps);
+    pbscratch_free(&scratch->reference);
+}
+
+#ifdef PB_STATS
+// Instrumentation of hot paths, compiled in with -DPB_STATS and read by pb.stats() (cleared by pb.reset_stats()).
+// Stages are timed by CLOCK_MONOTONIC in nanoseconds summed over all threads (workers compress, inflate
+// and parse in parallel): pack (dicts or columns to records), write (sinks: gzwrite, fwrite, waiting for
+// compressed blocks), compress (blocks on workers), read (gzread, decoders, inflate), parse (records to views)
+// and build (views to dicts or columns). Record sizes of packed and parsed records are counted by bit length.
+// Everything is updated by relaxed atomics, threads add what they counted locally once per batch
+// where they can. Without PB_STATS the macros below expand to nothing.
+enum {PBSTAGE_PACK, PBSTAGE_WRITE, PBSTAGE_COMPRESS, PBSTAGE_READ, PBSTAGE_PARSE, PBSTAGE_BUILD, PBSTAGE_COUNT};
+static const char* const pbstage_names[PBSTAGE_COUNT] = {"pack", "write", "compress", "read", "parse", "build"};
+
+// sizes[i] counts records of i bits of size: 0, 1, 2-3, 4-7, ... (wide records take up to 32 bits)
+#define PBSTATS_SIZE_BITS 33
+
+typedef struct pbstats_records_s {
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t max_size;
+    uint64_t sizes[PBSTATS_SIZE_BITS];
+} pbstats_records_t;
+
+typedef struct pbstats_s {
+    uint64_t ns[PBSTAGE_COUNT];
+    uint64_t calls[PBSTAGE_COUNT];
+    uint64_t bytes_written;  // to files, compressed
+    uint64_t bytes_read;  // of files, compressed
+    uint64_t built;  // dicts (or rows of columns)
+    pbstats_records_t packed;
+    pbstats_records_t parsed;
+} pbstats_t;
+
+static pbstats_t pbstats;  // of uint64_t only, see pbstats_reset
+
+static inline uint64_t pbstats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void pbstats_add(uint64_t* counter, uint64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline void pbstats_stop(int stage, uint64_t started) {
+    pbstats_add(&pbstats.ns[stage], pbstats_now() - started);
+    pbstats_add(&pbstats.calls[stage], 1);
+}
+
+// Count record of size in records of a thread (not shared, see pbstats_merge).
+static inline void pbstats_record(pbstats_records_t* records, uint64_t size) {
+    records->records++;
+    records->bytes += size;
+    records->max_size = size > records->max_size ? size : records->max_size;
+    records->sizes[size ? 64 - __builtin_clzll(size) : 0]++;
+}
+
+static void pbstats_merge(pbstats_records_t* into, const pbstats_records_t* records) {
+    if (!records->records)
+        return;
+    pbstats_add(&into->records, records->records);
+    pbstats_add(&into->bytes, records->bytes);
+    uint64_t max_size = __atomic_load_n(&into->max_size, __ATOMIC_RELAXED);
+    while (records->max_size > max_size
+           && !__atomic_compare_exchange_n(&into->max_size, &max_size, records->max_size, 1, __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED))
+        ;
+    for (int i = 0; i < PBSTATS_SIZE_BITS; i++)
+        if (records->sizes[i])
+            pbstats_add(&into->sizes[i], records->sizes[i]);
+}
+
+// Position in file of gzFile (0 for none), gzip readers and writers count deltas of it
+static inline uint64_t pbstats_gzoffset(gzFile zfile) {
+    return zfile ? (uint64_t)gzoffset(zfile) : 0;
+}
+
+static void pbstats_reset(void) {
+    uint64_t* counters = (uint64_t*)&pbstats;
+    for (size_t i = 0; i < sizeof(pbstats_t) / sizeof(uint64_t); i++)
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+}
+
+#define PBSTATS_START(started) uint64_t started = pbstats_now()
+#define PBSTATS_STOP(stage, started) pbstats_stop(stage, started)
+#define PBSTATS_ADD(counter, n) pbstats_add(&pbstats.counter, n)
+#define PBSTATS_RECORDS(records) pbstats_records_t records = {0}
+#define PBSTATS_RECORD(records, size) pbstats_record(&records, size)
+#define PBSTATS_MERGE(counter, records) pbstats_merge(&pbstats.counter, &records)
+#define PBSTATS_GZOFFSET(zoffset, zfile) uint64_t zoffset = pbstats_gzoffset(zfile)
+#else
+#define PBSTATS_START(started)
+#define PBSTATS_STOP(stage, started)
+#define PBSTATS_ADD(counter, n)
+#define PBSTATS_RECORDS(records)
+#define PBSTATS_RECORD(records, size)
+#define PBSTATS_MERGE(counter, records)
+#define PBSTATS_GZOFFSET(zoffset, zfile)
+#endif
+
+// Python objects shared by all records, made once on module import (pbobjects_init).
+// Dict keys are interned strings (with cached hashes), so storing a field neither builds nor hashes its key.
+enum {PBKEY_DEVICE, PBKEY_ID, PBKEY_TYPE, PBKEY_APPS, PBKEY_LAT, PBKEY_LON, PBKEY_COUNT};
+static const char* const pbkey_names[PBKEY_COUNT] = {"device", "id", "type", "apps", "lat", "lon"};
+static PyObject* pbkeys[PBKEY_COUNT];
+
+// Values of low cardinality fields (device.type: "idfa", "gaid", ...) are shared as well:
+// a direct mapped cache keeps the last string of every slot and returns it again for the same bytes.
+// They are not interned: values come from file data, evicted ones must be freed (interned strings are
+// immortal since Python 3.12). Used with the GIL held.
+#define PBSTRCACHE_SIZE 64
+#define PBSTRCACHE_MAX_LEN 16
+
+typedef struct pbstrcache_entry_s {
+    PyObject* value;
+    size_t len;
+    uint8_t data[PBSTRCACHE_MAX_LEN];
+} pbstrcache_entry_t;
+
+static pbstrcache_entry_t pbstrcache[PBSTRCACHE_SIZE];
+
+// Return string of UTF-8 data of len bytes (new reference) or NULL on error (with Python exception set).
+static PyObject* pbstrcache_get(const uint8_t* data, size_t len) {
+    if (len > PBSTRCACHE_MAX_LEN)
+        return PyUnicode_FromStringAndSize((const char*)data, len);
+    uint32_t hash = 2166136261u;  // FNV-1a
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ data[i]) * 16777619u;
+    pbstrcache_entry_t* entry = &pbstrcache[hash % PBSTRCACHE_SIZE];
+    if (entry->value && entry->len == len && !memcmp(entry->data, data, len)) {
+        Py_INCREF(entry->value);
+        return entry->value;
+    }
+    PyObject* value = PyUnicode_FromStringAndSize((const char*)data, len);
+    if (value == NULL)
+        return NULL;
+    Py_INCREF(value);
+    Py_XDECREF(entry->value);
+    entry->value = value;
+    entry->len = len;
+    memcpy(entry->data, data, len);
+    return value;
+}
+
+// Return 0 on success or -1 on error (with Python exception set).
+static int pbobjects_init(void) {
+    for (int i = 0; i < PBKEY_COUNT; i++)
+        if (!(pbkeys[i] = PyUnicode_InternFromString(pbkey_names[i])))
+            return -1;
+    return 0;
+}
+
+#ifdef PB_VALIDATE_DECODER
+// Bump-pointer arena for protobuf-c unpacking, reset between records.
+// Allocations are carved from one block; whatever does not fit goes to overflow chunks,
+// which are released on reset and the block is grown to cover them next time.
+// Thus in the steady state unpacking does no heap allocations at all.
+typedef struct pbarena_chunk_s {
+    struct pbarena_chunk_s* next;
+    max_align_t data[];
+} pbarena_chunk_t;
+
+typedef struct pbarena_s {
+    pbscratch_t block;
+    size_t used;
+    size_t overflow;
+    pbarena_chunk_t* chunks;
+} pbarena_t;
+
+#define PBARENA_INIT {PBSCRATCH_INIT, 0, 0, NULL}
+#define PBARENA_ALIGN(size) (((size) + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1))
+
+static void* pbarena_alloc(void* allocator_data, size_t size) {
+    pbarena_t* arena = allocator_data;
+    size = PBARENA_ALIGN(size);
+    if (arena->used + size <= arena->block.size) {
+        void* ptr = (uint8_t*)arena->block.data + arena->used;
+        arena->used += size;
+        return ptr;
+    }
+    pbarena_chunk_t* chunk = malloc(sizeof(pbarena_chunk_t) + size);
+    if (!chunk)
+        return NULL;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->overflow += size;
+    return chunk->data;
+}
+
+static void pbarena_free(void* allocator_data, void* ptr) {
+    // memory is reclaimed all at once by pbarena_reset
+}
+
+static void pbarena_release_chunks(pbarena_t* arena) {
+    while (arena->chunks) {
+        pbarena_chunk_t* next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+}
+
+// Invalidate all allocations made so far
+static void pbarena_reset(pbarena_t* arena) {
+    if (arena->chunks) {
+        pbarena_release_chunks(arena);
+        // on failure keep old block, overflow chunks are used again
+        pbscratch_reserve(&arena->block, arena->used + arena->overflow);
+    }
+    arena->used = 0;
+    arena->overflow = 0;
+}
+
+static void pbarena_destroy(pbarena_t* arena) {
+    pbarena_release_chunks(arena);
+    pbscratch_free(&arena->block);
+    arena->used = 0;
+    arena->overflow = 0;
+}
+#endif
+
+// Return 1 if buffer format is of native uint32 items, 0 otherwise.
+static int is_uint32_format(const char* format) {
+    if (format[0] == '@' || format[0] == '=' || format[0] == (PY_LITTLE_ENDIAN ? '<' : '>'))
+        format++;
+    return (!strcmp(format, "I") || (sizeof(unsigned long) == sizeof(uint32_t) && !strcmp(format, "L")))
+        && sizeof(unsigned int) == sizeof(uint32_t);
+}
+
+// Get apps of py_apps into scratch->apps: list or tuple of ints (each in uint32 range),
+// or any one-dimensional contiguous buffer of uint32 (array.array("I"), numpy.uint32, ...), copied as is.
+// Put their number to *n_apps. Return apps (NULL if there are none) or NULL on error (with Python exception set).
+static uint32_t* get_apps(PyObject* py_apps, pbscratch_t* scratch, size_t* n_apps) {
+    if (PyList_Check(py_apps) || PyTuple_Check(py_apps)) {
+        *n_apps = PySequence_Fast_GET_SIZE(py_apps);
+        PyObject** items = PySequence_Fast_ITEMS(py_apps);
+        uint32_t* apps = pbscratch_reserve(scratch, *n_apps * sizeof(uint32_t));
+        if (*n_apps && !apps) {
+            PyErr_SetString(PyExc_MemoryError, "Memory Error.");
+            return NULL;
+        }
+        for (size_t i = 0; i < *n_apps; i++) {
+            PyObject* py_app = items[i];
+            if (!PyLong_Check(py_app)) {
+                PyErr_Format(PyExc_TypeError,
+                            "[app] element must be a int not a '%s'",
+                            Py_TYPE(py_app)->tp_name);
+                return NULL;
+            }
+            long long app = PyLong_AsLongLong(py_app);
+            if (app < 0 || app > UINT32_MAX) {
+                if (app != -1 || !PyErr_Occurred() || PyErr_ExceptionMatches(PyExc_OverflowError)) {
+                    PyErr_Clear();
+                    PyErr_Format(PyExc_OverflowError, "[app] element %R is out of uint32 range", py_app);
+                }
+                return NULL;
+            }
+            apps[i] = (uint32_t)app;
+        }
+        return apps;
+    }
+    if (!PyObject_CheckBuffer(py_apps)) {
+        PyErr_Format(PyExc_TypeError,
+                    "[apps] element must be a list, tuple or buffer of uint32 not a '%s'",
+                    Py_TYPE(py_apps)->tp_name);
+        return NULL;
+    }
+    Py_buffer buffer;
+    if (PyObject_GetBuffer(py_apps, &buffer, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0)
+        return NULL;
+    uint32_t* apps = NULL;
+    if (buffer.ndim != 1 || buffer.itemsize != sizeof(uint32_t) || !is_uint32_format(buffer.format)) {
+        PyErr_Format(PyExc_TypeError, "[apps] buffer must be of uint32 ('I') not of '%s'", buffer.format);
+    } else {
+        *n_apps = buffer.len / sizeof(uint32_t);
+        apps = pbscratch_reserve(scratch, buffer.len);
+        if (apps)
+            memcpy(apps, buffer.buf, buffer.len);
+        else if (*n_apps)
+            PyErr_SetString(PyExc_MemoryError, "Memory Error.");
+    }
+    PyBuffer_Release(&buffer);
+    return apps;
+}
+
+#ifdef PB_VALIDATE_ENCODER
+// Reference encoder: fill DeviceApps struct and pack it by protobuf-c into scratch->reference.
+// Return size of packed message or -1 on error (with Python exception set).
+static Py_ssize_t device_apps_pack_reference(PyObject* py_item, serialize_scratch_t* scratch) {
     // example: py_item = {"device": {"type": "gaid", "id": "e7e1a50c0ec2747ca56cd9e1558c0d7d"}, "lat": 42, "lon": -42, "apps": [1, 2]}
 
     // message DeviceApps {
@@ -30,11 +562,11 @@ size_t device_apps_serialize(PyObject* py_item, gzFile zfile) {
     // }
     DeviceApps pbf_device_apps = DEVICE_APPS__INIT;
     DeviceApps__Device pbf_device = DEVICE_APPS__DEVICE__INIT;
-    pbf_device_apps.device = &pbf_device;
 
     // optional Device device = 1;
     PyObject* py_device = PyDict_GetItemString(py_item, "device");
     if (py_device) {
+        pbf_device_apps.device = &pbf_device;
         if (!PyDict_Check(py_device)) {
             PyErr_Format(PyExc_TypeError,
                         "[device] element must be a dictionary not a '%s'",
@@ -77,36 +609,12 @@ size_t device_apps_serialize(PyObject* py_item, gzFile zfile) {
 
     // repeated uint32 apps = 2;
     // *refs repeated: this field can be repeated any number of times (INCLUDING ZERO) in a well-formed message. The order of the repeated values will be preserved.
+    // list, tuple or buffer of uint32, as device_apps_pack takes them
     PyObject* py_apps = PyDict_GetItemString(py_item, "apps");
     if (py_apps) {
-        if (!PyList_Check(py_apps)) {
-            PyErr_Format(PyExc_TypeError,
-                        "[apps] element must be a list not a '%s'",
-                        Py_TYPE(py_apps)->tp_name);            
+        pbf_device_apps.apps = get_apps(py_apps, &scratch->apps, &pbf_device_apps.n_apps);
+        if (!pbf_device_apps.apps && PyErr_Occurred())
             return -1;
-        }
-        size_t apps_size = PyList_Size(py_apps);
-        if (apps_size){
-            pbf_device_apps.n_apps = apps_size;
-//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            pbf_device_apps.apps = malloc(sizeof(size_t) * apps_size);          
-//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            if (!pbf_device_apps.apps) {
-                PyErr_SetString(PyExc_MemoryError, "Memory error.");
-                return -1;
-            }
-            for (size_t i = 0; i < apps_size; i++) {
-                PyObject* py_app = PyList_GET_ITEM(py_apps, i);
-                if ((py_app == NULL) || !PyLong_Check(py_app)) {
-                    PyErr_Format(PyExc_TypeError,
-                                "[app] element must be a int not a '%s'",
-                                Py_TYPE(py_app)->tp_name);            
-                    free(pbf_device_apps.apps);
-                    return -1;
-                }
-                pbf_device_apps.apps[i] = (uint32_t)PyLong_AsLong(py_app);
-            }
-        }
     }
 
     // optional double lat = 3;
@@ -115,7 +623,6 @@ size_t device_apps_serialize(PyObject* py_item, gzFile zfile) {
         pbf_device_apps.lat = PyFloat_AsDouble(py_lat);
         if (PyErr_Occurred() != NULL) {
             PyErr_SetString(PyExc_TypeError, "[lat] isn't a number.");
-            free(pbf_device_apps.apps);
             return -1;
         }         
         pbf_device_apps.has_lat = 1;
@@ -126,317 +633,3956 @@ size_t device_apps_serialize(PyObject* py_item, gzFile zfile) {
         pbf_device_apps.lon = PyFloat_AsDouble(py_lon);
         if (PyErr_Occurred() != NULL) {
             PyErr_SetString(PyExc_TypeError, "[lon] isn't a number.");
-            free(pbf_device_apps.apps);
             return -1;
         }         
         pbf_device_apps.has_lon = 1;
     }
     size_t device_apps_packed_size = device_apps__get_packed_size(&pbf_device_apps);
-//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    void* device_apps_buffer = malloc(device_apps_packed_size);
-//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    uint8_t* device_apps_buffer = pbscratch_reserve(&scratch->reference, device_apps_packed_size);
     if (!device_apps_buffer) {
         PyErr_SetString(PyExc_MemoryError, "Memory Error.");
-        free(pbf_device_apps.apps);
         return -1;
     }
-    device_apps__pack(&pbf_device_apps, device_apps_buffer);
+    return device_apps__pack(&pbf_device_apps, device_apps_buffer);
+}
+#endif
+
+// DeviceApps record parsed from wire format without touching Python objects,
+// so it can be done by worker threads. Strings point into the record data,
+// apps are stored in device_apps_batch_t.apps starting at apps_offset.
+typedef struct device_apps_view_s {
+    const uint8_t* data;  // the whole message
+    size_t length;
+    size_t header_size;  // of record, which starts at data - header_size
+    const uint8_t* device_id;
+    const uint8_t* device_type;
+    size_t device_id_len;
+    size_t device_type_len;
+    size_t apps_offset;
+    size_t n_apps;
+    double lat;
+    double lon;
+    uint8_t has_device;
+    uint8_t has_device_id;
+    uint8_t has_device_type;
+    uint8_t has_lat;
+    uint8_t has_lon;
+} device_apps_view_t;
+
+// Parsed records, buffers are reused between batches
+typedef struct device_apps_batch_s {
+    pbscratch_t views;
+    size_t n_views;
+    pbscratch_t apps;
+    size_t n_apps;
+} device_apps_batch_t;
+
+#define DEVICE_APPS_BATCH_INIT {PBSCRATCH_INIT, 0, PBSCRATCH_INIT, 0}
+
+static void device_apps_batch_reset(device_apps_batch_t* batch) {
+    batch->n_views = 0;
+    batch->n_apps = 0;
+}
+
+static void device_apps_batch_free(device_apps_batch_t* batch) {
+    pbscratch_free(&batch->views);
+    pbscratch_free(&batch->apps);
+    device_apps_batch_reset(batch);
+}
+
+// Wire format primitives (https://developers.google.com/protocol-buffers/docs/encoding)
+#define WIRE_VARINT 0
+#define WIRE_FIXED64 1
+#define WIRE_LENGTH_DELIMITED 2
+#define WIRE_FIXED32 5
+#define WIRE_TAG(field, wire_type) (((field) << 3) | (wire_type))
+#define VARINT32_MAX_SIZE 5
+
+static inline size_t varint_size(uint64_t value) {
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+static inline uint8_t* put_varint(uint8_t* out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+// doubles go little-endian regardless of the host byte order
+static inline uint8_t* put_fixed64(uint8_t* out, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    for (int i = 0; i < 8; i++)
+        out[i] = (uint8_t)(bits >> (8 * i));
+    return out + 8;
+}
+
+static inline uint8_t* put_bytes(uint8_t* out, uint32_t tag, const char* data, size_t len) {
+    *out++ = (uint8_t)tag;
+    out = put_varint(out, len);
+    memcpy(out, data, len);
+    return out + len;
+}
+
+// Get utf-8 content of optional string field of py_dict under one of pbkeys.
+// Return 1 if field is present, 0 if not and -1 on error (with Python exception set).
+static int get_string_field(PyObject* py_dict, int key, const char* name, const char** data, Py_ssize_t* len) {
+    PyObject* py_value = PyDict_GetItemWithError(py_dict, pbkeys[key]);
+    if (!py_value)
+        return PyErr_Occurred() ? -1 : 0;
+    *data = PyUnicode_AsUTF8AndSize(py_value, len);
+    if (!*data) {
+        PyErr_Format(PyExc_TypeError,
+                    "[%s] element must be a string not a '%s'",
+                    name, Py_TYPE(py_value)->tp_name);
+        return -1;
+    }
+    return 1;
+}
+
+// Get optional double field of py_dict under one of pbkeys.
+// Return 1 if field is present, 0 if not and -1 on error (with Python exception set).
+static int get_double_field(PyObject* py_dict, int key, double* value) {
+    PyObject* py_value = PyDict_GetItemWithError(py_dict, pbkeys[key]);
+    if (!py_value)
+        return PyErr_Occurred() ? -1 : 0;
+    *value = PyFloat_AsDouble(py_value);
+    if (*value == -1.0 && PyErr_Occurred()) {
+        PyErr_Format(PyExc_TypeError, "[%s] isn't a number.", pbkey_names[key]);
+        return -1;
+    }
+    return 1;
+}
+
+// Upper bound of record size (header + message) of view with n_apps apps
+static inline size_t device_apps_max_size(const device_apps_view_t* view, int packed) {
+    size_t device_len = (view->has_device_id ? 1 + varint_size(view->device_id_len) + view->device_id_len : 0)
+        + (view->has_device_type ? 1 + varint_size(view->device_type_len) + view->device_type_len : 0);
+    return PBHEADER_MAX_SIZE
+        + (view->has_device ? 1 + varint_size(device_len) + device_len : 0)
+        + view->n_apps * (1 + VARINT32_MAX_SIZE) + (packed ? 1 + VARINT32_MAX_SIZE : 0)
+        + (view->has_lat ? 9 : 0) + (view->has_lon ? 9 : 0);
+}
+
+// Encode view (apps are apps[view->apps_offset...]) to DeviceApps record (header + message)
+// at record, which has room for device_apps_max_size bytes. Touches no Python objects.
+// If packed, apps go as one packed field and record gets DEVICE_APPS_PACKED_TYPE.
+// header_flags (PBHEADER_WIDE, PBHEADER_CRC) go to type of header, which is wide anyway
+// if the message does not fit to pbheader_t.length.
+// Return size of record or -1 if message does not fit to wide header either.
+static Py_ssize_t device_apps_put(uint8_t* record, const device_apps_view_t* view, const uint32_t* apps, int packed,
+                                  uint16_t header_flags) {
+    size_t header_size = sizeof(pbheader_t) + (header_flags & PBHEADER_WIDE ? sizeof(uint32_t) : 0)
+        + (header_flags & PBHEADER_CRC ? sizeof(uint32_t) : 0);
+    uint8_t* message = record + header_size;
+    uint8_t* out = message;
+    if (view->has_device) {
+        size_t device_len = (view->has_device_id ? 1 + varint_size(view->device_id_len) + view->device_id_len : 0)
+            + (view->has_device_type ? 1 + varint_size(view->device_type_len) + view->device_type_len : 0);
+        *out++ = WIRE_TAG(1, WIRE_LENGTH_DELIMITED);
+        out = put_varint(out, device_len);
+        if (view->has_device_id)
+            out = put_bytes(out, WIRE_TAG(1, WIRE_LENGTH_DELIMITED), (const char*)view->device_id, view->device_id_len);
+        if (view->has_device_type)
+            out = put_bytes(out, WIRE_TAG(2, WIRE_LENGTH_DELIMITED), (const char*)view->device_type, view->device_type_len);
+    }
+    apps += view->apps_offset;
+    if (packed && view->n_apps) {
+        // packed values are written after room for the longest length prefix and moved back when length is known
+        uint8_t* apps_start = out + 1 + VARINT32_MAX_SIZE;
+        uint8_t* apps_end = apps_start;
+        for (size_t i = 0; i < view->n_apps; i++)
+            apps_end = put_varint(apps_end, apps[i]);
+        size_t apps_len = apps_end - apps_start;
+        *out++ = WIRE_TAG(2, WIRE_LENGTH_DELIMITED);
+        out = put_varint(out, apps_len);
+        memmove(out, apps_start, apps_len);
+        out += apps_len;
+    } else {
+        for (size_t i = 0; i < view->n_apps; i++) {
+            *out++ = WIRE_TAG(2, WIRE_VARINT);
+            out = put_varint(out, apps[i]);
+        }
+    }
+    if (view->has_lat) {
+        *out++ = WIRE_TAG(3, WIRE_FIXED64);
+        out = put_fixed64(out, view->lat);
+    }
+    if (view->has_lon) {
+        *out++ = WIRE_TAG(4, WIRE_FIXED64);
+        out = put_fixed64(out, view->lon);
+    }
 
+    size_t length = out - message;
+    if (length > UINT32_MAX)
+        return -1;
+    if (length > UINT16_MAX && !(header_flags & PBHEADER_WIDE)) {
+        // rare enough to move the message rather than to reserve room for wide header in every record
+        memmove(message + sizeof(uint32_t), message, length);
+        message += sizeof(uint32_t);
+        header_size += sizeof(uint32_t);
+        header_flags |= PBHEADER_WIDE;
+    }
     pbheader_t pbheader = PBHEADER_INIT;
-    pbheader.type = DEVICE_APPS_TYPE;
-    pbheader.length = device_apps_packed_size;
+    pbheader.type = (packed ? DEVICE_APPS_PACKED_TYPE : DEVICE_APPS_TYPE) | header_flags;
+    pbheader.length = header_flags & PBHEADER_WIDE ? 0 : length;
+    memcpy(record, &pbheader, sizeof(pbheader_t));
+    out = record + sizeof(pbheader_t);
+    if (header_flags & PBHEADER_WIDE) {
+        uint32_t wide_length = length;
+        memcpy(out, &wide_length, sizeof(uint32_t));
+        out += sizeof(uint32_t);
+    }
+    if (header_flags & PBHEADER_CRC) {
+        uint32_t crc = pbcrc32c(0, message, length);
+        memcpy(out, &crc, sizeof(uint32_t));
+    }
+    return header_size + length;
+}
+
+// Encode py_item dict straight to DeviceApps wire format, without intermediate DeviceApps struct:
+// fields are collected into view (apps into scratch->apps) and encoded by device_apps_put.
+// Record (pbheader_t + message) is put to scratch->record.
+// Return size of record or -1 on error (with Python exception set).
+static Py_ssize_t device_apps_pack(PyObject* py_item, serialize_scratch_t* scratch, int packed, uint16_t header_flags) {
+    device_apps_view_t view;
+    memset(&view, 0, sizeof(device_apps_view_t));
+    Py_ssize_t len;
+    int rc;
+
+    // optional Device device = 1;
+    PyObject* py_device = PyDict_GetItemWithError(py_item, pbkeys[PBKEY_DEVICE]);
+    if (py_device) {
+        if (!PyDict_Check(py_device)) {
+            PyErr_Format(PyExc_TypeError,
+                        "[device] element must be a dictionary not a '%s'",
+                        Py_TYPE(py_device)->tp_name);
+            return -1;
+        }
+        view.has_device = 1;
+        // optional bytes id = 1;
+        rc = get_string_field(py_device, PBKEY_ID, "device.id", (const char**)&view.device_id, &len);
+        if (rc < 0)
+            return -1;
+        view.has_device_id = rc;
+        view.device_id_len = len;
+        // optional bytes type = 2;
+        rc = get_string_field(py_device, PBKEY_TYPE, "device.type", (const char**)&view.device_type, &len);
+        if (rc < 0)
+            return -1;
+        view.has_device_type = rc;
+        view.device_type_len = len;
+    } else if (PyErr_Occurred()) {
+        return -1;
+    }
 
-    int pbheader_bytes_written = gzwrite(zfile, &pbheader, sizeof(pbheader_t));
-    int device_apps_bytes_written = gzwrite(zfile, device_apps_buffer, (unsigned int)device_apps_packed_size);
+    // repeated uint32 apps = 2;
+    uint32_t* apps = NULL;
+    PyObject* py_apps = PyDict_GetItemWithError(py_item, pbkeys[PBKEY_APPS]);
+    if (py_apps) {
+        apps = get_apps(py_apps, &scratch->apps, &view.n_apps);
+        if (!apps && PyErr_Occurred())
+            return -1;
+    } else if (PyErr_Occurred()) {
+        return -1;
+    }
 
-    free(pbf_device_apps.apps);
-    free(device_apps_buffer);
+    // optional double lat = 3; optional double lon = 4;
+    rc = get_double_field(py_item, PBKEY_LAT, &view.lat);
+    if (rc < 0)
+        return -1;
+    view.has_lat = rc;
+    rc = get_double_field(py_item, PBKEY_LON, &view.lon);
+    if (rc < 0)
+        return -1;
+    view.has_lon = rc;
 
-    if ( (pbheader_bytes_written != sizeof(pbheader_t)) || (device_apps_bytes_written != (int)device_apps_packed_size) ) {
-        PyErr_SetString(PyExc_OSError, "Serialization failed.");
+    uint8_t* record = pbscratch_reserve(&scratch->record, device_apps_max_size(&view, packed));
+    if (!record) {
+        PyErr_SetString(PyExc_MemoryError, "Memory Error.");
         return -1;
     }
-    return pbheader_bytes_written + device_apps_bytes_written;
+    Py_ssize_t record_size = device_apps_put(record, &view, apps, packed, header_flags);
+    if (record_size < 0)
+        PyErr_SetString(PyExc_ValueError, "Record is too long.");
+    return record_size;
 }
 
+// Serialize py_item dict to DeviceApps record (header + message) in scratch->record.
+// scratch buffers are owned by caller and reused between calls.
+// Build with -DPB_VALIDATE_ENCODER to check every (not packed) record against protobuf-c encoder.
+// Return size of record or -1 on error (with Python exception set).
+Py_ssize_t device_apps_serialize(PyObject* py_item, serialize_scratch_t* scratch, int packed, uint16_t header_flags) {
+    Py_ssize_t record_size = device_apps_pack(py_item, scratch, packed, header_flags);
+    if (record_size < 0)
+        return -1;
 
-// Read iterator of Python dicts
-// Pack them to DeviceApps protobuf and write to file with appropriate header
-// Return number of written bytes as Python integer
-static PyObject* py_deviceapps_xwrite_pb(PyObject* self, PyObject* args) {
-    PyObject* obj; /* iterable object iter(obj) / __iter__ / PyObject_GetIter(obj)   */
-    const char* fname; /* output file name */    
+#ifdef PB_VALIDATE_ENCODER
+    // protobuf-c packs apps as declared in deviceapps.proto, i.e. not packed
+    if (!packed) {
+        Py_ssize_t reference_size = device_apps_pack_reference(py_item, scratch);
+        if (reference_size < 0)
+            return -1;
+        size_t length;
+        Py_ssize_t header_size = pbheader_get(scratch->record.data, record_size, &length);
+        if ((reference_size != record_size - header_size)
+            || memcmp(scratch->reference.data, (uint8_t*)scratch->record.data + header_size, reference_size)) {
+            PyErr_SetString(PyExc_RuntimeError, "DeviceApps encoder output differs from protobuf-c.");
+            return -1;
+        }
+    }
+#endif
+    return record_size;
+}
 
-    if (!PyArg_ParseTuple(args, "Os", &obj, &fname))
-        return NULL;
+// Ordered job ring served by a pool of worker threads.
+// Jobs are processed in any order but handed back in submission order: sequence numbers
+// [completed, taken) are being processed or done, [taken, submitted) wait for a worker.
+// Every worker owns a context (z_stream, codec context) which is reused between jobs.
+enum {JOB_FREE, JOB_QUEUED, JOB_DONE, JOB_FAILED};
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    gzFile zfile = gzopen(fname, "wb");
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    if (!zfile) {
-        PyErr_Format(PyExc_OSError, "gzopen of '%s' failed.", fname);
-        return NULL;
+typedef struct pbjob_s {
+    int state;
+} pbjob_t;
+
+typedef struct pbpool_s {
+    pthread_t* threads;
+    int n_threads;
+    uint8_t* jobs;  // n_jobs jobs of job_size bytes, each starts with pbjob_t
+    size_t job_size;
+    size_t n_jobs;
+    size_t submitted;
+    size_t taken;
+    size_t completed;
+    int stop;
+    const void* arg;  // of worker_init
+    void* (*worker_init)(const void* arg);  // return worker context or NULL on error
+    void (*worker_free)(void* ctx);
+    int (*run)(pbjob_t* job, void* ctx);  // return JOB_DONE or JOB_FAILED
+    void (*job_free)(pbjob_t* job);
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+} pbpool_t;
+
+static inline pbjob_t* pbpool_job(pbpool_t* pool, size_t seq) {
+    return (pbjob_t*)(pool->jobs + (seq % pool->n_jobs) * pool->job_size);
+}
+
+static void* pbpool_worker(void* arg) {
+    pbpool_t* pool = arg;
+    void* ctx = pool->worker_init(pool->arg);
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->taken == pool->submitted && !pool->stop)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if (pool->taken == pool->submitted)
+            break;
+        pbjob_t* job = pbpool_job(pool, pool->taken++);
+        pthread_mutex_unlock(&pool->lock);
+        int state = ctx ? pool->run(job, ctx) : JOB_FAILED;
+        pthread_mutex_lock(&pool->lock);
+        job->state = state;
+        pthread_cond_broadcast(&pool->done);
     }
+    pthread_mutex_unlock(&pool->lock);
+    if (ctx)
+        pool->worker_free(ctx);
+    return NULL;
+}
 
-    //* https://docs.python.org/3/c-api/object.html
-    // This is equivalent to the Python expression iter(o). 
-    // It returns a new iterator for the object argument, or the object itself if the object is already an iterator. 
-    // Raises TypeError and returns NULL if the object cannot be iterated.
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    PyObject* py_iter = PyObject_GetIter(obj);  // https://docs.python.org/3/c-api/iter.html#c.PyIter_Check
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    if (py_iter == NULL) {
-        PyErr_SetString(PyExc_TypeError, "First argument must be Iterable.");
-        gzclose(zfile);
-        return NULL;
+// Stop workers (jobs not taken yet are dropped) and free jobs.
+static void pbpool_destroy(pbpool_t* pool) {
+    if (pool->threads) {
+        pthread_mutex_lock(&pool->lock);
+        pool->submitted = pool->taken;
+        pool->stop = 1;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+        for (int i = 0; i < pool->n_threads; i++)
+            pthread_join(pool->threads[i], NULL);
+        free(pool->threads);
+        pool->threads = NULL;
+    }
+    if (pool->jobs) {
+        for (size_t i = 0; i < pool->n_jobs; i++)
+            pool->job_free(pbpool_job(pool, i));
+        free(pool->jobs);
+        pool->jobs = NULL;
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+// Start n_threads workers over a ring of two jobs per worker (zero-initialized),
+// which keeps them busy while the main thread prepares or consumes jobs.
+// run, arg, worker_init, worker_free and job_free must be set by caller.
+// Return 0 on success or -1 on error (with Python exception set).
+static int pbpool_init(pbpool_t* pool, int n_threads, size_t job_size) {
+    pool->threads = NULL;
+    pool->n_threads = 0;
+    pool->job_size = job_size;
+    pool->n_jobs = 2 * n_threads;
+    pool->submitted = pool->taken = pool->completed = 0;
+    pool->stop = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->jobs = calloc(pool->n_jobs, job_size);
+    pool->threads = calloc(n_threads, sizeof(pthread_t));
+    if (!pool->jobs || !pool->threads) {
+        pbpool_destroy(pool);
+        PyErr_SetString(PyExc_MemoryError, "Memory error.");
+        return -1;
+    }
+    for (; pool->n_threads < n_threads; pool->n_threads++) {
+        if (pthread_create(&pool->threads[pool->n_threads], NULL, pbpool_worker, pool)) {
+            pbpool_destroy(pool);
+            PyErr_SetString(PyExc_OSError, "Failed to start worker thread.");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Queue job pbpool_job(pool, pool->submitted) filled by caller
+static void pbpool_submit(pbpool_t* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pbpool_job(pool, pool->submitted)->state = JOB_QUEUED;
+    pool->submitted++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Wait for the oldest submitted job, it stays owned by caller until pbpool_release.
+static pbjob_t* pbpool_wait(pbpool_t* pool) {
+    pbjob_t* job = pbpool_job(pool, pool->completed);
+    pthread_mutex_lock(&pool->lock);
+    while (job->state == JOB_QUEUED)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    return job;
+}
+
+static void pbpool_release(pbpool_t* pool) {
+    pbpool_job(pool, pool->completed)->state = JOB_FREE;
+    pool->completed++;
+}
+
+// Records are serialized into batches of about PBWRITE_BATCH bytes (a batch holds whole records only),
+// which are handed to a sink: gzwrite with the GIL released, parallel compressor or nothing (in memory encoding).
+// Writers take smaller batches (block_size=) for low latency, down to a record per block.
+#define PBWRITE_BATCH (256 * 1024)
+
+// Consumer of a batch of serialized records. It may swap batch buffer with its own one.
+// Return 0 on success or -1 on error (with Python exception set).
+typedef int (*serialize_sink_t)(void* sink_data, pbscratch_t* batch, size_t size);
+
+// Serialize py_item dict and append it to batch of *batch_size bytes in scratch->batch,
+// handing the batch to sink when it reaches block_size bytes (never if sink is NULL).
+// Return size of record or -1 on error (with Python exception set).
+static Py_ssize_t device_apps_serialize_append(PyObject* py_item, serialize_scratch_t* scratch, int packed,
+                                               uint16_t header_flags, serialize_sink_t sink, void* sink_data,
+                                               size_t block_size, size_t* batch_size) {
+    PBSTATS_START(started);
+    Py_ssize_t processed = device_apps_serialize(py_item, scratch, packed, header_flags);
+    if (processed < 0)
+        return -1;
+    PBSTATS_STOP(PBSTAGE_PACK, started);
+    PBSTATS_RECORDS(packed_records);
+    PBSTATS_RECORD(packed_records, processed);
+    PBSTATS_MERGE(packed, packed_records);
+    size_t size = *batch_size;
+    uint8_t* batch = pbscratch_reserve(&scratch->batch, size + processed);
+    if (!batch) {
+        PyErr_SetString(PyExc_MemoryError, "Memory error.");
+        return -1;
     }
+    memcpy(batch + size, scratch->record.data, processed);
+    size += processed;
+    if (sink && size >= block_size) {
+        *batch_size = 0;
+        return sink(sink_data, &scratch->batch, size) < 0 ? -1 : processed;
+    }
+    *batch_size = size;
+    return processed;
+}
+
+// Serialize dicts of py_iter (other items are skipped) into scratch->batch after *batch_size bytes
+// of a batch being filled (0 for a new one), handing the batch to sink whenever it reaches block_size bytes
+// (never if sink is NULL). The last (possibly empty) batch stays in scratch->batch, its size is put to *batch_size.
+// Return number of serialized bytes or -1 on error (with Python exception set).
+static Py_ssize_t device_apps_serialize_iter(PyObject* py_iter, serialize_scratch_t* scratch, int packed, uint16_t header_flags,
+                                             serialize_sink_t sink, void* sink_data, size_t block_size,
+                                             size_t* batch_size) {
     size_t total_bytes = 0;
     PyObject* py_item;
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     while ((py_item = PyIter_Next(py_iter))) {
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
         if (PyDict_Check(py_item)) {
-            size_t processed = device_apps_serialize(py_item, zfile);
+            Py_ssize_t processed = device_apps_serialize_append(py_item, scratch, packed, header_flags,
+                                                                sink, sink_data, block_size, batch_size);
             if (processed < 0) {
                 Py_DECREF(py_item);
-                Py_DECREF(py_iter);
-                gzclose(zfile);
-                return NULL;
-            } 
+                return -1;
+            }
             total_bytes += processed;
         }
         // else { terms of task does not specify what to do in this case. so let's continue. }
         Py_DECREF(py_item);
-    }    
-    Py_DECREF(py_iter);
-    gzclose(zfile);
-    return PyLong_FromSize_t(total_bytes);  
+    }
+    if (PyErr_Occurred())  // raised by iterator
+        return -1;
+    return total_bytes;
 }
 
-PyObject* deserialize(DeviceApps* pbf_device_apps) {
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    PyObject* py_device_apps = PyDict_New();
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    if (py_device_apps == NULL) {            
-        PyErr_SetFromErrno(PyExc_RuntimeError);      
-        goto error;
-    }
+// Header flags of records of writers' wide= and checksum= arguments
+static inline uint16_t pbheader_flags(int wide, int checksum) {
+    return (wide ? PBHEADER_WIDE : 0) | (checksum ? PBHEADER_CRC : 0);
+}
+
+// Compress and write batch to gzFile with the GIL released.
+static int gzwrite_sink(void* sink_data, pbscratch_t* batch, size_t size) {
+    int bytes_written;
+    Py_BEGIN_ALLOW_THREADS
+    PBSTATS_START(started);
+    PBSTATS_GZOFFSET(zoffset, (gzFile)sink_data);
+    bytes_written = gzwrite((gzFile)sink_data, batch->data, (unsigned int)size);
+    PBSTATS_ADD(bytes_written, pbstats_gzoffset((gzFile)sink_data) - zoffset);
+    PBSTATS_STOP(PBSTAGE_WRITE, started);
+    Py_END_ALLOW_THREADS
+    if (bytes_written != (int)size) {
+        PyErr_SetString(PyExc_OSError, "Serialization failed.");
+        return -1;
+    }
+    return 0;
+}
+
+// Block codecs of compressed files.
+// Every block of records is compressed into a self-contained frame (gzip member, zstd frame, lz4 frame)
+// and frames are concatenated, which makes a valid file for the codec's own tools (gzip -d, zstd -d, lz4 -d).
+// Files are told apart by the magic bytes of their first frame. Contexts are reused between blocks.
+// zstd and lz4 are built in if their libraries are found by setup.py (HAVE_ZSTD, HAVE_LZ4).
+// A codec may support dictionaries (zstd): small frames are compressed against a dictionary
+// trained on records (see deviceapps_train_dictionary), its id is stored in every frame header.
+// Compression level (level=) is from 0 to max_level, a negative one stands for the codec's default.
+typedef struct pbcodec_s {
+    const char* name;
+    uint8_t magic[4];
+    size_t magic_size;
+    int max_level;  // -1 if codec takes no level
+    // cdict is NULL or made by cdict_new (whose level is used then), NULL on error
+    void* (*cctx_new)(const void* cdict, int level);
+    void (*cctx_free)(void* cctx);
+    size_t (*bound)(void* cctx, size_t size);  // of compressed frame of size bytes
+    // Compress size bytes of input into a frame at output (capacity >= bound), return its size or 0 on error.
+    size_t (*compress)(void* cctx, const uint8_t* input, size_t size, uint8_t* output, size_t capacity);
+    // Stream decompression (see pbdecoder_t), NULL for gzip which is read through gzFile.
+    void* (*dctx_new)(const void* ddict);  // ddict is NULL or made by ddict_new
+    void (*dctx_free)(void* dctx);
+    // Decompress from *input into *output advancing both.
+    // Return 0 if a frame has ended, 1 if it goes on and -1 on error.
+    int (*decompress)(void* dctx, const uint8_t** input, const uint8_t* input_end, uint8_t** output, uint8_t* output_end);
+    // Dictionaries, NULL if not supported.
+    // Digested once and shared by contexts of all threads, NULL on error.
+    void* (*cdict_new)(const uint8_t* data, size_t size, int level);
+    void (*cdict_free)(void* cdict);
+    void* (*ddict_new)(const uint8_t* data, size_t size);
+    void (*ddict_free)(void* ddict);
+    uint32_t (*dict_id)(const uint8_t* data, size_t size);  // of dictionary, 0 if it has none
+    uint32_t (*frame_dict_id)(const uint8_t* frame, size_t size);  // of frame header, 0 if none
+} pbcodec_t;
+
+static void* gzip_cctx_new(const void* cdict, int level) {
+    z_stream* strm = calloc(1, sizeof(z_stream));
+    if (strm && deflateInit2(strm, level < 0 ? Z_DEFAULT_COMPRESSION : level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(strm);
+        return NULL;
+    }
+    return strm;
+}
+
+static void gzip_cctx_free(void* cctx) {
+    deflateEnd(cctx);
+    free(cctx);
+}
+
+static size_t gzip_bound(void* cctx, size_t size) {
+    return deflateBound(cctx, size);
+}
+
+static size_t gzip_compress(void* cctx, const uint8_t* input, size_t size, uint8_t* output, size_t capacity) {
+    z_stream* strm = cctx;
+    strm->next_in = (uint8_t*)input;
+    strm->avail_in = size;
+    strm->next_out = output;
+    strm->avail_out = capacity;
+    int rc = deflate(strm, Z_FINISH);
+    size_t output_size = capacity - strm->avail_out;
+    deflateReset(strm);
+    return rc == Z_STREAM_END ? output_size : 0;
+}
+
+#ifdef HAVE_ZSTD
+// Frames carry content checksum, as gzip members do.
+static void* zstd_cctx_new(const void* cdict, int level) {
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    if (cctx) {
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+        if (level >= 0)
+            ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+        if (cdict && ZSTD_isError(ZSTD_CCtx_refCDict(cctx, cdict))) {
+            ZSTD_freeCCtx(cctx);
+            return NULL;
+        }
+    }
+    return cctx;
+}
+
+static void zstd_cctx_free(void* cctx) {
+    ZSTD_freeCCtx(cctx);
+}
+
+static size_t zstd_bound(void* cctx, size_t size) {
+    return ZSTD_compressBound(size);
+}
+
+static size_t zstd_compress(void* cctx, const uint8_t* input, size_t size, uint8_t* output, size_t capacity) {
+    size_t rc = ZSTD_compress2(cctx, output, capacity, input, size);
+    return ZSTD_isError(rc) ? 0 : rc;
+}
+
+static void* zstd_dctx_new(const void* ddict) {
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    if (dctx && ddict && ZSTD_isError(ZSTD_DCtx_refDDict(dctx, ddict))) {
+        ZSTD_freeDCtx(dctx);
+        return NULL;
+    }
+    return dctx;
+}
+
+static void zstd_dctx_free(void* dctx) {
+    ZSTD_freeDCtx(dctx);
+}
+
+static int zstd_decompress(void* dctx, const uint8_t** input, const uint8_t* input_end, uint8_t** output, uint8_t* output_end) {
+    ZSTD_inBuffer in = {*input, input_end - *input, 0};
+    ZSTD_outBuffer out = {*output, output_end - *output, 0};
+    size_t rc = ZSTD_decompressStream(dctx, &out, &in);
+    *input += in.pos;
+    *output += out.pos;
+    if (ZSTD_isError(rc))
+        return -1;
+    return rc != 0;
+}
+
+// Level 0 is the default one, as for frames without dictionary.
+static void* zstd_cdict_new(const uint8_t* data, size_t size, int level) {
+    return ZSTD_createCDict(data, size, level < 0 ? ZSTD_CLEVEL_DEFAULT : level);
+}
+
+static void zstd_cdict_free(void* cdict) {
+    ZSTD_freeCDict(cdict);
+}
+
+static void* zstd_ddict_new(const uint8_t* data, size_t size) {
+    return ZSTD_createDDict(data, size);
+}
+
+static void zstd_ddict_free(void* ddict) {
+    ZSTD_freeDDict(ddict);
+}
+
+static uint32_t zstd_dict_id(const uint8_t* data, size_t size) {
+    return ZDICT_getDictID(data, size);
+}
+
+static uint32_t zstd_frame_dict_id(const uint8_t* frame, size_t size) {
+    return ZSTD_getDictID_fromFrame(frame, size);
+}
+#endif
+
+#ifdef HAVE_LZ4
+// Frames carry content checksum, as gzip members do.
+static const LZ4F_preferences_t lz4_preferences = {.frameInfo = {.contentChecksumFlag = LZ4F_contentChecksumEnabled}};
+
+static void* lz4_cctx_new(const void* cdict, int level) {
+    LZ4F_cctx* cctx;
+    return LZ4F_isError(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION)) ? NULL : cctx;
+}
+
+static void lz4_cctx_free(void* cctx) {
+    LZ4F_freeCompressionContext(cctx);
+}
+
+static size_t lz4_bound(void* cctx, size_t size) {
+    return LZ4F_compressFrameBound(size, &lz4_preferences);
+}
+
+static size_t lz4_compress(void* cctx, const uint8_t* input, size_t size, uint8_t* output, size_t capacity) {
+    size_t header = LZ4F_compressBegin(cctx, output, capacity, &lz4_preferences);
+    if (LZ4F_isError(header))
+        return 0;
+    size_t body = LZ4F_compressUpdate(cctx, output + header, capacity - header, input, size, NULL);
+    if (LZ4F_isError(body))
+        return 0;
+    size_t end = LZ4F_compressEnd(cctx, output + header + body, capacity - header - body, NULL);
+    if (LZ4F_isError(end))
+        return 0;
+    return header + body + end;
+}
+
+static void* lz4_dctx_new(const void* ddict) {
+    LZ4F_dctx* dctx;
+    return LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)) ? NULL : dctx;
+}
+
+static void lz4_dctx_free(void* dctx) {
+    LZ4F_freeDecompressionContext(dctx);
+}
+
+static int lz4_decompress(void* dctx, const uint8_t** input, const uint8_t* input_end, uint8_t** output, uint8_t* output_end) {
+    size_t input_size = input_end - *input;
+    size_t output_size = output_end - *output;
+    size_t rc = LZ4F_decompress(dctx, *output, &output_size, *input, &input_size, NULL);
+    *input += input_size;
+    *output += output_size;
+    if (LZ4F_isError(rc))
+        return -1;
+    return rc != 0;
+}
+#endif
+
+static const pbcodec_t pbcodecs[] = {
+    {"gzip", {0x1f, 0x8b}, 2, 9, gzip_cctx_new, gzip_cctx_free, gzip_bound, gzip_compress},
+#ifdef HAVE_ZSTD
+    {"zstd", {0x28, 0xb5, 0x2f, 0xfd}, 4, 19, zstd_cctx_new, zstd_cctx_free, zstd_bound, zstd_compress,
+     zstd_dctx_new, zstd_dctx_free, zstd_decompress,
+     zstd_cdict_new, zstd_cdict_free, zstd_ddict_new, zstd_ddict_free, zstd_dict_id, zstd_frame_dict_id},
+#endif
+#ifdef HAVE_LZ4
+    {"lz4", {0x04, 0x22, 0x4d, 0x18}, 4, -1, lz4_cctx_new, lz4_cctx_free, lz4_bound, lz4_compress,
+     lz4_dctx_new, lz4_dctx_free, lz4_decompress},
+#endif
+};
+
+#define PBCODECS_COUNT (sizeof(pbcodecs) / sizeof(pbcodecs[0]))
+#define PBCODEC_GZIP (&pbcodecs[0])
+
+// Find codec by name, "none" gives NULL (records are written uncompressed).
+// Return 0 on success or -1 on unknown name (with Python exception set).
+static int parse_codec(const char* name, const pbcodec_t** codec) {
+    *codec = NULL;
+    if (!strcmp(name, "none"))
+        return 0;
+    for (size_t i = 0; i < PBCODECS_COUNT; i++) {
+        if (!strcmp(name, pbcodecs[i].name)) {
+            *codec = &pbcodecs[i];
+            return 0;
+        }
+    }
+    PyErr_Format(PyExc_ValueError, "Unknown codec '%s' (not built in?).", name);
+    return -1;
+}
+
+// Return codec whose magic starts data of size bytes or NULL.
+static const pbcodec_t* pbcodec_detect(const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < PBCODECS_COUNT; i++)
+        if (size >= pbcodecs[i].magic_size && !memcmp(data, pbcodecs[i].magic, pbcodecs[i].magic_size))
+            return &pbcodecs[i];
+    return NULL;
+}
+
+// Parallel block writer (pigz-style).
+// Every batch of records becomes a block which is compressed by a worker into a frame of the codec,
+// and frames are written to file in submission order.
+// Concatenated gzip members form a valid gzip file (RFC 1952, 2.2), so gzip -d and gzread read it as is,
+// the same holds for zstd and lz4 frames.
+typedef struct pbblock_s {
+    pbjob_t job;
+    pbscratch_t input;
+    size_t input_size;
+    pbscratch_t output;
+    size_t output_size;
+} pbblock_t;
+
+// Codec of blocks with its level and digested dictionary (or NULL), shared by workers
+typedef struct pbblock_codec_s {
+    const pbcodec_t* codec;
+    int level;
+    void* cdict;
+} pbblock_codec_t;
+
+typedef struct pbblock_worker_s {
+    const pbcodec_t* codec;
+    void* cctx;
+} pbblock_worker_t;
+
+static void* pbblock_worker_init(const void* arg) {
+    const pbblock_codec_t* codec = arg;
+    pbblock_worker_t* worker = malloc(sizeof(pbblock_worker_t));
+    if (!worker)
+        return NULL;
+    worker->codec = codec->codec;
+    worker->cctx = codec->codec->cctx_new(codec->cdict, codec->level);
+    if (!worker->cctx) {
+        free(worker);
+        return NULL;
+    }
+    return worker;
+}
+
+static void pbblock_worker_free(void* ctx) {
+    pbblock_worker_t* worker = ctx;
+    worker->codec->cctx_free(worker->cctx);
+    free(worker);
+}
+
+// Compress block input into a frame
+static int pbblock_compress(pbjob_t* job, void* ctx) {
+    pbblock_t* block = (pbblock_t*)job;
+    pbblock_worker_t* worker = ctx;
+    uint8_t* output = pbscratch_reserve(&block->output, worker->codec->bound(worker->cctx, block->input_size));
+    if (!output)
+        return JOB_FAILED;
+    PBSTATS_START(started);
+    block->output_size = worker->codec->compress(worker->cctx, block->input.data, block->input_size, output, block->output.size);
+    PBSTATS_STOP(PBSTAGE_COMPRESS, started);
+    return block->output_size ? JOB_DONE : JOB_FAILED;
+}
+
+static void pbblock_free(pbjob_t* job) {
+    pbblock_t* block = (pbblock_t*)job;
+    pbscratch_free(&block->input);
+    pbscratch_free(&block->output);
+}
+
+// Block index, written to "<file>.idx" sidecar by deviceapps_xwrite_pb(index=True).
+// Every block is a gzip member of whole records, so reading can start at any of them:
+// an entry per block gives ordinal of its first record, its offset in uncompressed stream
+// and offset of its member in the file, the last entry gives totals (and file size).
+// Header check ties index to contents of the file, so that an index of another file of the same size
+// is not used (see pbindex_file_check).
+// Numbers are in host byte order, as pbheader_t.
+#define PBINDEX_MAGIC "PBIX"
+#define PBINDEX_VERSION 2
+#define PBINDEX_SUFFIX ".idx"
+#define PBINDEX_CHECK_SIZE 4096
+
+typedef struct pbindex_header_s {
+    char magic[4];
+    uint32_t version;
+    uint64_t n_entries;
+    uint64_t check;
+} pbindex_header_t;
+
+typedef struct pbindex_entry_s {
+    uint64_t record;
+    uint64_t offset;
+    uint64_t zoffset;
+} pbindex_entry_t;
+
+// Return malloc'ed name of index sidecar of fname or NULL on memory error (with Python exception set).
+static char* pbindex_fname(const char* fname) {
+    char* index_fname = malloc(strlen(fname) + sizeof(PBINDEX_SUFFIX));
+    if (!index_fname) {
+        PyErr_SetString(PyExc_MemoryError, "Memory error.");
+        return NULL;
+    }
+    strcpy(index_fname, fname);
+    strcat(index_fname, PBINDEX_SUFFIX);
+    return index_fname;
+}
+
+// Number of records in batch of whole records
+static size_t pbindex_count_records(const uint8_t* batch, size_t size) {
+    size_t n = 0;
+    size_t length;
+    Py_ssize_t header_size;
+    for (size_t pos = 0; (header_size = pbheader_get(batch + pos, size - pos, &length)) > 0; n++)
+        pos += header_size + length;
+    return n;
+}
+
+// Put CRC32C of the first and the last PBINDEX_CHECK_SIZE bytes (of all of a smaller file) of file fd
+// of size bytes to *check. Return 0 on success or -1 on read error.
+static int pbindex_file_check(int fd, uint64_t size, uint64_t* check) {
+    uint8_t buffer[PBINDEX_CHECK_SIZE];
+    uint64_t offsets[2] = {0, size > PBINDEX_CHECK_SIZE ? size - PBINDEX_CHECK_SIZE : 0};
+    uint32_t crc = 0;
+    for (int i = 0; i < 2; i++) {
+        size_t n = size - offsets[i] < PBINDEX_CHECK_SIZE ? size - offsets[i] : PBINDEX_CHECK_SIZE;
+        if (pread(fd, buffer, n, offsets[i]) != (ssize_t)n)
+            return -1;
+        crc = pbcrc32c(crc, buffer, n);
+    }
+    *check = crc;
+    return 0;
+}
+
+typedef struct pbblock_writer_s {
+    pbpool_t pool;
+    pbblock_codec_t codec;
+    FILE* file;
+    uint64_t zoffset;  // compressed bytes written
+    int index;  // collect entries, one per submitted block
+    pbscratch_t entries;
+    size_t n_entries;
+    uint64_t records;  // submitted
+    uint64_t offset;  // uncompressed bytes submitted
+    uint64_t check;  // of written file for index header (see pbindex_file_check)
+} pbblock_writer_t;
+
+// Wait for the oldest submitted block and write its gzip member to file.
+// The GIL is released for waiting and writing.
+// Return 0 on success or -1 on error (with Python exception set).
+static int pbblock_write_next(pbblock_writer_t* writer) {
+    pbblock_t* block;
+    int state;
+    size_t bytes_written = 0;
+    if (writer->index)
+        ((pbindex_entry_t*)writer->entries.data)[writer->pool.completed].zoffset = writer->zoffset;
+    Py_BEGIN_ALLOW_THREADS
+    PBSTATS_START(started);
+    block = (pbblock_t*)pbpool_wait(&writer->pool);
+    state = block->job.state;
+    if (state == JOB_DONE)
+        bytes_written = fwrite(block->output.data, 1, block->output_size, writer->file);
+    PBSTATS_ADD(bytes_written, bytes_written);
+    PBSTATS_STOP(PBSTAGE_WRITE, started);
+    Py_END_ALLOW_THREADS
+    pbpool_release(&writer->pool);
+    writer->zoffset += bytes_written;
+    if (state == JOB_FAILED) {
+        PyErr_SetString(PyExc_MemoryError, "Compression failed.");
+        return -1;
+    }
+    if (bytes_written != block->output_size) {
+        PyErr_SetString(PyExc_OSError, "Serialization failed.");
+        return -1;
+    }
+    return 0;
+}
+
+// Hand batch to workers (its buffer is swapped with a free block one), then make sure the next block is free.
+static int pbblock_sink(void* sink_data, pbscratch_t* batch, size_t size) {
+    pbblock_writer_t* writer = sink_data;
+    pbpool_t* pool = &writer->pool;
+    if (writer->index) {
+        pbindex_entry_t* entries = pbscratch_reserve(&writer->entries, (writer->n_entries + 1) * sizeof(pbindex_entry_t));
+        if (!entries) {
+            PyErr_SetString(PyExc_MemoryError, "Memory error.");
+            return -1;
+        }
+        entries[writer->n_entries++] = (pbindex_entry_t){writer->records, writer->offset, 0};
+        writer->records += pbindex_count_records(batch->data, size);
+        writer->offset += size;
+    }
+    pbblock_t* block = (pbblock_t*)pbpool_job(pool, pool->submitted);
+    pbscratch_t input = block->input;
+    block->input = *batch;
+    block->input_size = size;
+    *batch = input;
+    pbpool_submit(pool);
+    if (pool->submitted - pool->completed == pool->n_jobs)
+        return pbblock_write_next(writer);
+    return 0;
+}
+
+// Write batch to FILE as is with the GIL released.
+static int fwrite_sink(void* sink_data, pbscratch_t* batch, size_t size) {
+    size_t bytes_written;
+    Py_BEGIN_ALLOW_THREADS
+    PBSTATS_START(started);
+    bytes_written = fwrite(batch->data, 1, size, (FILE*)sink_data);
+    PBSTATS_ADD(bytes_written, bytes_written);
+    PBSTATS_STOP(PBSTAGE_WRITE, started);
+    Py_END_ALLOW_THREADS
+    if (bytes_written != size) {
+        PyErr_SetString(PyExc_OSError, "Serialization failed.");
+        return -1;
+    }
+    return 0;
+}
+
+// Output file of serialized records: gzFile (gzip, threads == 1), parallel block writer (other codecs,
+// threads > 1 or index) or plain FILE (codec "none", framed records as they are, which readers map into memory).
+// A sidecar index left from previous contents of the file is removed, index writes a new one on close.
+typedef struct pbwriter_s {
+    gzFile zfile;
+    pbblock_writer_t blocks;
+    FILE* file;
+    serialize_sink_t sink;
+    void* sink_data;
+    size_t block_size;  // of batches handed to sink
+    char* index_fname;
+} pbwriter_t;
+
+// dictionary (NULL if not given) must be one with id, as made by deviceapps_train_dictionary,
+// it is used for every block, on a thread even if threads == 1.
+// level < 0 is the codec's default, buffer_size > 0 is given to gzbuffer (gzFile) or setvbuf (FILE).
+// background compresses gzip blocks on a thread even if threads == 1 (instead of gzwrite by the caller).
+// Return 0 on success or -1 on error (with Python exception set).
+static int pbwriter_open(pbwriter_t* writer, const char* fname, int threads, int index, const pbcodec_t* codec,
+                         Py_ssize_t block_size, const Py_buffer* dictionary, int level, Py_ssize_t buffer_size,
+                         int background) {
+    if (threads < 1) {
+        PyErr_SetString(PyExc_ValueError, "threads must be positive.");
+        return -1;
+    }
+    if (block_size < 1) {
+        PyErr_SetString(PyExc_ValueError, "block_size must be positive.");
+        return -1;
+    }
+    if (index && !codec) {
+        PyErr_SetString(PyExc_ValueError, "index requires a codec.");
+        return -1;
+    }
+    if (level >= 0 && !(codec && codec->max_level >= 0)) {
+        PyErr_Format(PyExc_ValueError, "Codec '%s' takes no level.", codec ? codec->name : "none");
+        return -1;
+    }
+    if (level >= 0 && level > codec->max_level) {
+        PyErr_Format(PyExc_ValueError, "level of codec '%s' must be at most %d.", codec->name, codec->max_level);
+        return -1;
+    }
+    if (buffer_size < 0) {
+        PyErr_SetString(PyExc_ValueError, "buffer_size must not be negative.");
+        return -1;
+    }
+    if (dictionary && !(codec && codec->cdict_new)) {
+        PyErr_Format(PyExc_ValueError, "Codec '%s' takes no dictionary.", codec ? codec->name : "none");
+        return -1;
+    }
+    if (dictionary && !codec->dict_id(dictionary->buf, dictionary->len)) {
+        PyErr_SetString(PyExc_ValueError, "Dictionary has no id (not made by deviceapps_train_dictionary?).");
+        return -1;
+    }
+    writer->zfile = NULL;
+    writer->file = NULL;
+    writer->block_size = block_size;
+    writer->blocks.codec = (pbblock_codec_t){codec, level, NULL};
+    writer->blocks.file = NULL;
+    writer->blocks.zoffset = 0;
+    writer->blocks.index = index;
+    writer->blocks.entries = (pbscratch_t)PBSCRATCH_INIT;
+    writer->blocks.n_entries = 0;
+    writer->blocks.records = writer->blocks.offset = 0;
+    writer->blocks.check = 0;
+    writer->index_fname = pbindex_fname(fname);
+    if (!writer->index_fname)
+        return -1;
+    unlink(writer->index_fname);
+    if (!index) {
+        free(writer->index_fname);
+        writer->index_fname = NULL;
+    }
+    if (!codec) {
+        writer->file = fopen(fname, "wb");
+        if (!writer->file) {
+            PyErr_Format(PyExc_OSError, "fopen of '%s' failed.", fname);
+            return -1;
+        }
+        if (buffer_size)
+            setvbuf(writer->file, NULL, _IOFBF, buffer_size);
+        writer->sink = fwrite_sink;
+        writer->sink_data = writer->file;
+        return 0;
+    }
+    if (codec == PBCODEC_GZIP && threads == 1 && !index && !dictionary && !background) {
+        char mode[4] = "wb";
+        if (level >= 0)
+            mode[2] = '0' + level;
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+        writer->zfile = gzopen(fname, mode);
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+        if (!writer->zfile) {
+            PyErr_Format(PyExc_OSError, "gzopen of '%s' failed.", fname);
+            return -1;
+        }
+        if (buffer_size && gzbuffer(writer->zfile, buffer_size) < 0) {
+            gzclose(writer->zfile);
+            PyErr_SetString(PyExc_ValueError, "buffer_size is too small for gzbuffer.");
+            return -1;
+        }
+        writer->sink = gzwrite_sink;
+        writer->sink_data = writer->zfile;
+        return 0;
+    }
+    writer->blocks.file = fopen(fname, index ? "w+b" : "wb");  // index reads it back for its check
+    if (!writer->blocks.file) {
+        PyErr_Format(PyExc_OSError, "fopen of '%s' failed.", fname);
+        free(writer->index_fname);
+        return -1;
+    }
+    if (buffer_size)
+        setvbuf(writer->blocks.file, NULL, _IOFBF, buffer_size);
+    if (dictionary) {
+        writer->blocks.codec.cdict = codec->cdict_new(dictionary->buf, dictionary->len, level);
+        if (!writer->blocks.codec.cdict) {
+            fclose(writer->blocks.file);
+            free(writer->index_fname);
+            PyErr_SetString(PyExc_ValueError, "Dictionary is malformed.");
+            return -1;
+        }
+    }
+    writer->blocks.pool.arg = &writer->blocks.codec;
+    writer->blocks.pool.worker_init = pbblock_worker_init;
+    writer->blocks.pool.worker_free = pbblock_worker_free;
+    writer->blocks.pool.run = pbblock_compress;
+    writer->blocks.pool.job_free = pbblock_free;
+    if (pbpool_init(&writer->blocks.pool, threads, sizeof(pbblock_t)) < 0) {
+        if (writer->blocks.codec.cdict)
+            codec->cdict_free(writer->blocks.codec.cdict);
+        fclose(writer->blocks.file);
+        free(writer->index_fname);
+        return -1;
+    }
+    writer->sink = pbblock_sink;
+    writer->sink_data = &writer->blocks;
+    return 0;
+}
+
+// Write entries of block writer with totals entry to index_fname.
+// Return 0 on success or -1 on error (with Python exception set).
+static int pbwriter_write_index(pbblock_writer_t* writer, const char* index_fname) {
+    pbindex_entry_t* entries = pbscratch_reserve(&writer->entries, (writer->n_entries + 1) * sizeof(pbindex_entry_t));
+    if (!entries) {
+        PyErr_SetString(PyExc_MemoryError, "Memory error.");
+        return -1;
+    }
+    entries[writer->n_entries] = (pbindex_entry_t){writer->records, writer->offset, writer->zoffset};
+    pbindex_header_t header = {PBINDEX_MAGIC, PBINDEX_VERSION, writer->n_entries + 1, writer->check};
+    FILE* file = fopen(index_fname, "wb");
+    if (!file) {
+        PyErr_Format(PyExc_OSError, "fopen of '%s' failed.", index_fname);
+        return -1;
+    }
+    int ok = fwrite(&header, sizeof(pbindex_header_t), 1, file) == 1
+        && fwrite(entries, sizeof(pbindex_entry_t), header.n_entries, file) == header.n_entries;
+    if (fclose(file) || !ok) {
+        unlink(index_fname);
+        PyErr_SetString(PyExc_OSError, "Index write failed.");
+        return -1;
+    }
+    return 0;
+}
+
+// Write batch of size bytes (if any) and everything buffered so far to file, so that it ends with whole records
+// readable as they are: gzip stream is flushed to a byte boundary (Z_SYNC_FLUSH), blocks are written as frames.
+// Return 0 on success or -1 on error (with Python exception set).
+static int pbwriter_flush(pbwriter_t* writer, pbscratch_t* batch, size_t size) {
+    if (size && writer->sink(writer->sink_data, batch, size) < 0)
+        return -1;
+    int rc;
+    if (writer->zfile) {
+        Py_BEGIN_ALLOW_THREADS
+        PBSTATS_START(started);
+        PBSTATS_GZOFFSET(zoffset, writer->zfile);
+        rc = gzflush(writer->zfile, Z_SYNC_FLUSH);
+        PBSTATS_ADD(bytes_written, pbstats_gzoffset(writer->zfile) - zoffset);
+        PBSTATS_STOP(PBSTAGE_WRITE, started);
+        Py_END_ALLOW_THREADS
+        rc = rc != Z_OK;
+    } else if (writer->file) {
+        Py_BEGIN_ALLOW_THREADS
+        rc = fflush(writer->file);
+        Py_END_ALLOW_THREADS
+    } else {
+        pbpool_t* pool = &writer->blocks.pool;
+        while (pool->completed < pool->submitted)
+            if (pbblock_write_next(&writer->blocks) < 0)
+                return -1;
+        Py_BEGIN_ALLOW_THREADS
+        rc = fflush(writer->blocks.file);
+        Py_END_ALLOW_THREADS
+    }
+    if (rc) {
+        PyErr_SetString(PyExc_OSError, "Flush failed.");
+        return -1;
+    }
+    return 0;
+}
+
+// Write the last batch (unless failed), close the file and write index if requested.
+// Return 0 on success or -1 on error (with Python exception set).
+static int pbwriter_close(pbwriter_t* writer, pbscratch_t* batch, size_t batch_size, int failed) {
+    if (!failed && batch_size)
+        failed = writer->sink(writer->sink_data, batch, batch_size) < 0;
+    int rc;
+    if (writer->zfile) {
+        Py_BEGIN_ALLOW_THREADS
+        PBSTATS_START(started);
+        PBSTATS_GZOFFSET(zoffset, writer->zfile);
+#ifdef PB_STATS
+        // finish the stream first to count its tail, gzclose does not start another member after it
+        gzflush(writer->zfile, Z_FINISH);
+#endif
+        PBSTATS_ADD(bytes_written, pbstats_gzoffset(writer->zfile) - zoffset);
+        rc = gzclose(writer->zfile);
+        PBSTATS_STOP(PBSTAGE_WRITE, started);
+        Py_END_ALLOW_THREADS
+        rc = rc != Z_OK;
+    } else if (writer->file) {
+        Py_BEGIN_ALLOW_THREADS
+        rc = fclose(writer->file);
+        Py_END_ALLOW_THREADS
+    } else {
+        pbpool_t* pool = &writer->blocks.pool;
+        while (!failed && pool->completed < pool->submitted)
+            failed = pbblock_write_next(&writer->blocks) < 0;
+        pbpool_destroy(pool);
+        if (writer->blocks.codec.cdict)
+            writer->blocks.codec.codec->cdict_free(writer->blocks.codec.cdict);
+        if (!failed && writer->index_fname && (fflush(writer->blocks.file)
+            || pbindex_file_check(fileno(writer->blocks.file), writer->blocks.zoffset, &writer->blocks.check) < 0)) {
+            PyErr_SetString(PyExc_OSError, "Index write failed.");
+            failed = 1;
+        }
+        rc = fclose(writer->blocks.file);
+    }
+    if (!failed && rc)
+        PyErr_SetString(PyExc_OSError, "Serialization failed.");
+    else if (!failed && writer->index_fname)
+        rc = pbwriter_write_index(&writer->blocks, writer->index_fname);
+    pbscratch_free(&writer->blocks.entries);
+    free(writer->index_fname);
+    return failed || rc ? -1 : 0;
+}
+
+
+// Read iterator of Python dicts
+// Pack them to DeviceApps protobuf and write to file with appropriate header
+// packed=True writes apps as packed field with DEVICE_APPS_PACKED_TYPE header (smaller for long app lists)
+// wide=True gives every record a wide header (PBHEADER_WIDE), records over 64 KiB get it anyway
+// checksum=True adds CRC32C of message to every header (PBHEADER_CRC), see deviceapps_xread_pb(recover=)
+// threads > 1 compresses blocks of records on that many threads, output is multi-member gzip
+// index=True writes it so (on a thread even if threads == 1) with block index to "<fname>.idx",
+// which lets deviceapps_xread_pb(start=) seek to the block of a record (see pbindex_entry_t)
+// codec="zstd" or "lz4" (if built in) compresses blocks into frames of that codec (on a thread even if threads == 1),
+// codec="none" writes records uncompressed, for intermediate files read back through mmap
+// block_size is the size of uncompressed blocks (PBWRITE_BATCH), small blocks compress well with
+// dictionary=bytes of deviceapps_train_dictionary (codec="zstd"), which readers need then
+// Return number of written (uncompressed) bytes as Python integer
+static PyObject* py_deviceapps_xwrite_pb(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"", "", "packed", "wide", "checksum", "threads", "index", "codec", "block_size", "dictionary",
+                             NULL};
+    PyObject* obj; /* iterable object iter(obj) / __iter__ / PyObject_GetIter(obj)   */
+    const char* fname; /* output file name */    
+    int packed = 0;
+    int wide = 0;
+    int checksum = 0;
+    int threads = 1;
+    int index = 0;
+    const char* codec_name = "gzip";
+    const pbcodec_t* codec;
+    Py_ssize_t block_size = PBWRITE_BATCH;
+    Py_buffer dictionary = {NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Os|$pppipsny*", kwlist, &obj, &fname, &packed, &wide, &checksum,
+                                     &threads, &index, &codec_name, &block_size, &dictionary))
+        return NULL;
+    if (parse_codec(codec_name, &codec) < 0) {
+        PyBuffer_Release(&dictionary);
+        return NULL;
+    }
+
+    //* https://docs.python.org/3/c-api/object.html
+    // This is equivalent to the Python expression iter(o). 
+    // It returns a new iterator for the object argument, or the object itself if the object is already an iterator. 
+    // Raises TypeError and returns NULL if the object cannot be iterated.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    PyObject* py_iter = PyObject_GetIter(obj);  // https://docs.python.org/3/c-api/iter.html#c.PyIter_Check
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    if (py_iter == NULL) {
+        PyErr_SetString(PyExc_TypeError, "First argument must be Iterable.");
+        PyBuffer_Release(&dictionary);
+        return NULL;
+    }
+    pbwriter_t writer;
+    int rc = pbwriter_open(&writer, fname, threads, index, codec, block_size, dictionary.buf ? &dictionary : NULL, -1, 0, 0);
+    PyBuffer_Release(&dictionary);
+    if (rc < 0) {
+        Py_DECREF(py_iter);
+        return NULL;
+    }
+    serialize_scratch_t scratch = SERIALIZE_SCRATCH_INIT;
+    size_t batch_size = 0;
+    Py_ssize_t total_bytes = device_apps_serialize_iter(py_iter, &scratch, packed, pbheader_flags(wide, checksum),
+                                                        writer.sink, writer.sink_data,
+                                                        writer.block_size, &batch_size);
+    Py_DECREF(py_iter);
+    if (pbwriter_close(&writer, &scratch.batch, batch_size, total_bytes < 0) < 0)
+        total_bytes = -1;
+    serialize_scratch_free(&scratch);
+    if (total_bytes < 0)
+        return NULL;
+    return PyLong_FromSsize_t(total_bytes);  
+}
+
+// Sharded writer: records of one iterable are routed to shards, every shard has a file of its own,
+// a writer compressing its blocks on threads of its own (so shards are compressed in parallel while
+// the caller serializes records) and scratch buffers of its own.
+typedef struct pbshard_s {
+    pbwriter_t writer;
+    serialize_scratch_t scratch;
+    size_t batch_size;  // of batch being filled in scratch.batch
+    size_t records;
+    size_t bytes;  // serialized (uncompressed)
+    int opened;
+} pbshard_t;
+
+// Return shard of py_item by CRC32C of UTF-8 device.id (as pb.crc32c(id.encode()) % n_shards): records without
+// device.id (or with malformed device, which the serializer then reports) go to shard of empty id, 0.
+// Return -1 on error (with Python exception set).
+static Py_ssize_t pbshard_by_id(PyObject* py_item, Py_ssize_t n_shards) {
+    PyObject* py_device = PyDict_GetItemWithError(py_item, pbkeys[PBKEY_DEVICE]);
+    if (!py_device || !PyDict_Check(py_device))
+        return PyErr_Occurred() ? -1 : 0;
+    PyObject* py_id = PyDict_GetItemWithError(py_device, pbkeys[PBKEY_ID]);
+    if (!py_id || !PyUnicode_Check(py_id))
+        return PyErr_Occurred() ? -1 : 0;
+    Py_ssize_t len;
+    const char* id = PyUnicode_AsUTF8AndSize(py_id, &len);
+    if (!id)
+        return -1;
+    return pbcrc32c(0, (const uint8_t*)id, len) % n_shards;
+}
+
+// Read iterator of Python dicts and write them to shards files, name of shard i is template.format(i)
+// by="device.id" routes records by hash of device.id (see pbshard_by_id), so every device is in one shard,
+// by="round-robin" deals them out in turn
+// threads (per shard) and other arguments are as of deviceapps_xwrite_pb, level as of pb.Writer;
+// shards compress on threads even with codec="gzip" and threads=1, their files have a gzip member per block then;
+// records are serialized (and routed) on the calling thread with the GIL held, one after another for all shards,
+// only compression and writing of shards run in parallel
+// Return list of (records, bytes) of shards, bytes are written (uncompressed) ones
+static PyObject* py_deviceapps_xwrite_sharded(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"", "", "shards", "by", "packed", "wide", "checksum", "threads", "index", "codec",
+                             "block_size", "dictionary", "level", NULL};
+    PyObject* obj;
+    PyObject* py_template;
+    Py_ssize_t n_shards;
+    const char* by = "device.id";
+    int packed = 0;
+    int wide = 0;
+    int checksum = 0;
+    int threads = 1;
+    int index = 0;
+    const char* codec_name = "gzip";
+    const pbcodec_t* codec;
+    Py_ssize_t block_size = PBWRITE_BATCH;
+    Py_buffer dictionary = {NULL};
+    int level = -1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OUn|$spppipsny*i", kwlist, &obj, &py_template, &n_shards, &by,
+                                     &packed, &wide, &checksum, &threads, &index, &codec_name, &block_size,
+                                     &dictionary, &level))
+        return NULL;
+    int round_robin = !strcmp(by, "round-robin");
+    PyObject* result = NULL;
+    PyObject* py_iter = NULL;
+    PyObject* py_names = NULL;
+    pbshard_t* shards = NULL;
+    PyObject* py_item;
+    size_t next = 0;  // shard of round-robin
+    Py_ssize_t i;
+    if (n_shards < 1) {
+        PyErr_SetString(PyExc_ValueError, "shards must be positive.");
+        goto done;
+    }
+    if (!round_robin && strcmp(by, "device.id")) {
+        PyErr_Format(PyExc_ValueError, "Unknown by '%s' (device.id or round-robin).", by);
+        goto done;
+    }
+    if (parse_codec(codec_name, &codec) < 0)
+        goto done;
+    py_iter = PyObject_GetIter(obj);
+    if (py_iter == NULL) {
+        PyErr_SetString(PyExc_TypeError, "First argument must be Iterable.");
+        goto done;
+    }
+    shards = calloc(n_shards, sizeof(pbshard_t));
+    py_names = PySet_New(NULL);
+    if (!shards || !py_names) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (i = 0; i < n_shards; i++) {
+        PyObject* py_name = PyObject_CallMethod(py_template, "format", "n", i);
+        if (py_name == NULL)
+            goto close;
+        if (PySet_Add(py_names, py_name) < 0 || PySet_GET_SIZE(py_names) != i + 1) {
+            if (!PyErr_Occurred())
+                PyErr_Format(PyExc_ValueError, "Template gives '%U' to more than one shard.", py_name);
+            Py_DECREF(py_name);
+            goto close;
+        }
+        const char* fname = PyUnicode_AsUTF8(py_name);
+        Py_DECREF(py_name);  // kept alive by the set
+        if (!fname || pbwriter_open(&shards[i].writer, fname, threads, index, codec, block_size,
+                                    dictionary.buf ? &dictionary : NULL, level, 0, 1) < 0)
+            goto close;
+        shards[i].scratch = (serialize_scratch_t)SERIALIZE_SCRATCH_INIT;
+        shards[i].opened = 1;
+    }
+
+    while ((py_item = PyIter_Next(py_iter))) {
+        if (PyDict_Check(py_item)) {
+            Py_ssize_t shard_index = round_robin ? (Py_ssize_t)(next++ % n_shards) : pbshard_by_id(py_item, n_shards);
+            pbshard_t* shard = &shards[shard_index < 0 ? 0 : shard_index];
+            Py_ssize_t processed = shard_index < 0 ? -1 : device_apps_serialize_append(
+                py_item, &shard->scratch, packed, pbheader_flags(wide, checksum), shard->writer.sink, shard->writer.sink_data,
+                shard->writer.block_size, &shard->batch_size);
+            if (processed < 0) {
+                Py_DECREF(py_item);
+                goto close;
+            }
+            shard->records++;
+            shard->bytes += processed;
+        }
+        Py_DECREF(py_item);
+    }
+
+close:
+    {
+        int failed = PyErr_Occurred() != NULL;
+        for (i = 0; i < n_shards && shards[i].opened; i++) {
+            failed |= pbwriter_close(&shards[i].writer, &shards[i].scratch.batch, shards[i].batch_size, failed) < 0;
+            serialize_scratch_free(&shards[i].scratch);
+        }
+        if (failed)
+            goto done;
+    }
+    result = PyList_New(n_shards);
+    for (i = 0; result && i < n_shards; i++) {
+        PyObject* py_counts = Py_BuildValue("(nn)", (Py_ssize_t)shards[i].records, (Py_ssize_t)shards[i].bytes);
+        if (py_counts == NULL)
+            Py_CLEAR(result);
+        else
+            PyList_SET_ITEM(result, i, py_counts);
+    }
+
+done:
+    free(shards);
+    Py_XDECREF(py_names);
+    Py_XDECREF(py_iter);
+    PyBuffer_Release(&dictionary);
+    return result;
+}
+
+// Streaming writer: pb.Writer(fname, ...) keeps the file, its compressor and scratch buffers open
+// between write() calls, so records can be appended as they come. Records are batched as by
+// deviceapps_xwrite_pb, flush() writes out the batch being filled and makes the file end with whole records.
+typedef struct {
+    PyObject_HEAD
+    pbwriter_t writer;
+    serialize_scratch_t scratch;
+    size_t batch_size;  // of batch being filled in scratch.batch
+    int packed;
+    uint16_t header_flags;
+    Py_ssize_t bytes_written;  // serialized (uncompressed) bytes
+    char closed;
+    int failed;  // output failed, the file is only closed then
+    int busy;  // a method runs, possibly with the GIL released or calling Python code
+} DeviceAppsWriterObject;
+
+// Sink of writer's batches, which marks it failed on error
+static int deviceapps_writer_sink(void* sink_data, pbscratch_t* batch, size_t size) {
+    DeviceAppsWriterObject* self = sink_data;
+    if (self->writer.sink(self->writer.sink_data, batch, size) < 0) {
+        self->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// Return 0 if records can be written or -1 (with Python exception set).
+static int deviceapps_writer_check(DeviceAppsWriterObject* self) {
+    if (self->busy) {
+        PyErr_SetString(PyExc_ValueError, "Writer already executing.");
+        return -1;
+    }
+    if (self->closed) {
+        PyErr_SetString(PyExc_ValueError, "I/O operation on closed Writer.");
+        return -1;
+    }
+    if (self->failed) {
+        PyErr_SetString(PyExc_OSError, "Writer failed on previous write.");
+        return -1;
+    }
+    return 0;
+}
+
+// Write the batch being filled (unless failed) and close the file.
+// Return 0 on success or -1 on error (with Python exception set).
+static int deviceapps_writer_close_file(DeviceAppsWriterObject* self) {
+    if (self->closed)
+        return 0;
+    self->closed = 1;
+    int rc = pbwriter_close(&self->writer, &self->scratch.batch, self->batch_size, self->failed);
+    serialize_scratch_free(&self->scratch);
+    // after failure close reports no error of its own, the failed write has raised
+    return self->failed ? 0 : rc;
+}
+
+static void deviceapps_writer_dealloc(DeviceAppsWriterObject* self) {
+    PyObject *type, *value, *traceback;
+    PyErr_Fetch(&type, &value, &traceback);
+    if (deviceapps_writer_close_file(self) < 0)
+        PyErr_WriteUnraisable((PyObject*)self);
+    PyErr_Restore(type, value, traceback);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+// Writer(fname, packed=False, wide=False, checksum=False, threads=1, index=False, codec="gzip",
+//        block_size=262144, dictionary=None, level=-1, buffer_size=0)
+// Arguments are those of deviceapps_xwrite_pb, besides
+// level is compression level of codec (gzip 0-9, zstd 0-19, no lz4 ones), -1 for its default,
+// buffer_size is the size of gzbuffer() of gzip file (threads=1) or stdio buffer of other files, 0 for the default.
+static PyObject* deviceapps_writer_new(PyTypeObject* type, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"", "packed", "wide", "checksum", "threads", "index", "codec", "block_size", "dictionary",
+                             "level", "buffer_size", NULL};
+    const char* fname;
+    int packed = 0;
+    int wide = 0;
+    int checksum = 0;
+    int threads = 1;
+    int index = 0;
+    const char* codec_name = "gzip";
+    const pbcodec_t* codec;
+    Py_ssize_t block_size = PBWRITE_BATCH;
+    Py_buffer dictionary = {NULL};
+    int level = -1;
+    Py_ssize_t buffer_size = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|$pppipsny*in", kwlist, &fname, &packed, &wide, &checksum,
+                                     &threads, &index, &codec_name, &block_size, &dictionary, &level, &buffer_size))
+        return NULL;
+    if (parse_codec(codec_name, &codec) < 0) {
+        PyBuffer_Release(&dictionary);
+        return NULL;
+    }
+    DeviceAppsWriterObject* self = (DeviceAppsWriterObject*)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        PyBuffer_Release(&dictionary);
+        return NULL;
+    }
+    self->scratch = (serialize_scratch_t)SERIALIZE_SCRATCH_INIT;
+    self->packed = packed;
+    self->header_flags = pbheader_flags(wide, checksum);
+    int rc = pbwriter_open(&self->writer, fname, threads, index, codec, block_size, dictionary.buf ? &dictionary : NULL,
+                           level, buffer_size, 0);
+    PyBuffer_Release(&dictionary);
+    if (rc < 0) {
+        self->closed = 1;
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject*)self;
+}
+
+static PyObject* deviceapps_writer_write(DeviceAppsWriterObject* self, PyObject* py_item) {
+    if (deviceapps_writer_check(self) < 0)
+        return NULL;
+    if (!PyDict_Check(py_item)) {
+        PyErr_SetString(PyExc_TypeError, "Record must be dict.");
+        return NULL;
+    }
+    self->busy = 1;
+    Py_ssize_t processed = device_apps_serialize_append(py_item, &self->scratch, self->packed, self->header_flags,
+                                                        deviceapps_writer_sink, self, self->writer.block_size,
+                                                        &self->batch_size);
+    self->busy = 0;
+    if (processed < 0)
+        return NULL;
+    self->bytes_written += processed;
+    return PyLong_FromSsize_t(processed);
+}
+
+static PyObject* deviceapps_writer_write_many(DeviceAppsWriterObject* self, PyObject* obj) {
+    if (deviceapps_writer_check(self) < 0)
+        return NULL;
+    PyObject* py_iter = PyObject_GetIter(obj);
+    if (py_iter == NULL) {
+        PyErr_SetString(PyExc_TypeError, "Argument must be Iterable.");
+        return NULL;
+    }
+    self->busy = 1;
+    Py_ssize_t processed = device_apps_serialize_iter(py_iter, &self->scratch, self->packed, self->header_flags,
+                                                      deviceapps_writer_sink, self, self->writer.block_size,
+                                                      &self->batch_size);
+    self->busy = 0;
+    Py_DECREF(py_iter);
+    if (processed < 0)
+        return NULL;
+    self->bytes_written += processed;
+    return PyLong_FromSsize_t(processed);
+}
+
+static PyObject* deviceapps_writer_flush(DeviceAppsWriterObject* self, PyObject* Py_UNUSED(ignored)) {
+    if (deviceapps_writer_check(self) < 0)
+        return NULL;
+    self->busy = 1;
+    size_t size = self->batch_size;
+    self->batch_size = 0;
+    int rc = pbwriter_flush(&self->writer, &self->scratch.batch, size);
+    self->busy = 0;
+    if (rc < 0) {
+        self->failed = 1;
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject* deviceapps_writer_close(DeviceAppsWriterObject* self, PyObject* Py_UNUSED(ignored)) {
+    if (self->busy) {
+        PyErr_SetString(PyExc_ValueError, "Writer already executing.");
+        return NULL;
+    }
+    self->busy = 1;
+    int rc = deviceapps_writer_close_file(self);
+    self->busy = 0;
+    if (rc < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject* deviceapps_writer_enter(DeviceAppsWriterObject* self, PyObject* Py_UNUSED(ignored)) {
+    if (deviceapps_writer_check(self) < 0)
+        return NULL;
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject* deviceapps_writer_exit(DeviceAppsWriterObject* self, PyObject* args) {
+    PyObject* result = deviceapps_writer_close(self, NULL);
+    if (result == NULL)
+        return NULL;
+    Py_DECREF(result);
+    Py_RETURN_FALSE;
+}
+
+static PyMemberDef DeviceAppsWriterMembers[] = {
+    {"bytes_written", T_PYSSIZET, offsetof(DeviceAppsWriterObject, bytes_written), READONLY,
+     "Serialized (uncompressed) bytes written so far"},
+    {"closed", T_BOOL, offsetof(DeviceAppsWriterObject, closed), READONLY, "True if the file is closed"},
+    {NULL}
+};
+
+static PyMethodDef DeviceAppsWriterMethods[] = {
+    {"write", (PyCFunction)deviceapps_writer_write, METH_O, "Write record dict, return its size in bytes"},
+    {"write_many", (PyCFunction)deviceapps_writer_write_many, METH_O,
+     "Write record dicts of iterable (other items are skipped), return their size in bytes"},
+    {"flush", (PyCFunction)deviceapps_writer_flush, METH_NOARGS,
+     "Write out buffered records, the file ends with whole records then (gzip stream at Z_SYNC_FLUSH)"},
+    {"close", (PyCFunction)deviceapps_writer_close, METH_NOARGS, "Write out buffered records and close the file"},
+    {"__enter__", (PyCFunction)deviceapps_writer_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)deviceapps_writer_exit, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject DeviceAppsWriterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "pb.Writer",
+    .tp_doc = "Writer(fname, packed=False, wide=False, checksum=False, threads=1, index=False, codec='gzip', "
+              "block_size=262144, dictionary=None, level=-1, buffer_size=0)\n"
+              "Streaming writer of DeviceApps dicts to protobuf file, as deviceapps_xwrite_pb writes it",
+    .tp_basicsize = sizeof(DeviceAppsWriterObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = deviceapps_writer_new,
+    .tp_dealloc = (destructor)deviceapps_writer_dealloc,
+    .tp_methods = DeviceAppsWriterMethods,
+    .tp_members = DeviceAppsWriterMembers,
+};
+
+// Serialize iterator of Python dicts to framed stream (pbheader_t + DeviceApps per record) in memory,
+// the same that deviceapps_xwrite_pb writes before compression.
+// Return bytes
+static PyObject* py_deviceapps_encode(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"", "packed", "wide", "checksum", NULL};
+    PyObject* obj;
+    int packed = 0;
+    int wide = 0;
+    int checksum = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|$ppp", kwlist, &obj, &packed, &wide, &checksum))
+        return NULL;
+    PyObject* py_iter = PyObject_GetIter(obj);
+    if (py_iter == NULL) {
+        PyErr_SetString(PyExc_TypeError, "First argument must be Iterable.");
+        return NULL;
+    }
+    serialize_scratch_t scratch = SERIALIZE_SCRATCH_INIT;
+    size_t batch_size = 0;
+    Py_ssize_t total_bytes = device_apps_serialize_iter(py_iter, &scratch, packed, pbheader_flags(wide, checksum), NULL, NULL, 0,
+                                                        &batch_size);
+    Py_DECREF(py_iter);
+    PyObject* py_bytes = total_bytes < 0 ? NULL : PyBytes_FromStringAndSize(scratch.batch.data, batch_size);
+    serialize_scratch_free(&scratch);
+    return py_bytes;
+}
+
+#ifdef HAVE_ZSTD
+// Train dictionary of codec="zstd" on a sample of Python dicts, every record serialized as
+// deviceapps_xwrite_pb writes it (pbheader_t included) is a sample. Records of small blocks
+// (block_size=) share device types and app id patterns with it, which makes them compress well.
+// size is the maximum size of dictionary (112640, as of zstd --train)
+// Return dictionary as bytes, for dictionary= of writers and readers
+static PyObject* py_deviceapps_train_dictionary(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"", "size", "packed", NULL};
+    PyObject* obj;
+    Py_ssize_t capacity = 112640;
+    int packed = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|$np", kwlist, &obj, &capacity, &packed))
+        return NULL;
+    if (capacity < 256) {
+        PyErr_SetString(PyExc_ValueError, "size must be at least 256.");
+        return NULL;
+    }
+    PyObject* py_iter = PyObject_GetIter(obj);
+    if (py_iter == NULL) {
+        PyErr_SetString(PyExc_TypeError, "First argument must be Iterable.");
+        return NULL;
+    }
+    serialize_scratch_t scratch = SERIALIZE_SCRATCH_INIT;
+    size_t batch_size = 0;
+    Py_ssize_t total_bytes = device_apps_serialize_iter(py_iter, &scratch, packed, 0, NULL, NULL, 0, &batch_size);
+    Py_DECREF(py_iter);
+    PyObject* py_bytes = NULL;
+    size_t n_samples = pbindex_count_records(scratch.batch.data, batch_size);
+    size_t* sample_sizes = malloc((n_samples + 1) * sizeof(size_t));
+    void* dictionary = malloc(capacity);
+    if (total_bytes < 0)
+        goto done;
+    if (!sample_sizes || !dictionary) {
+        PyErr_SetString(PyExc_MemoryError, "Memory error.");
+        goto done;
+    }
+    size_t pos = 0;
+    for (size_t i = 0; i < n_samples; i++) {
+        size_t length = 0;
+        sample_sizes[i] = pbheader_get((const uint8_t*)scratch.batch.data + pos, batch_size - pos, &length) + length;
+        pos += sample_sizes[i];
+    }
+    size_t size;
+    Py_BEGIN_ALLOW_THREADS
+    size = ZDICT_trainFromBuffer(dictionary, capacity, scratch.batch.data, sample_sizes, n_samples);
+    Py_END_ALLOW_THREADS
+    if (ZDICT_isError(size))
+        PyErr_Format(PyExc_ValueError, "Dictionary training failed: %s (too few records?).", ZDICT_getErrorName(size));
+    else
+        py_bytes = PyBytes_FromStringAndSize(dictionary, size);
+
+done:
+    free(dictionary);
+    free(sample_sizes);
+    serialize_scratch_free(&scratch);
+    return py_bytes;
+}
+#endif
+
+PyObject* deserialize(DeviceApps* pbf_device_apps) {
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    PyObject* py_device_apps = PyDict_New();
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    if (py_device_apps == NULL) {            
+        PyErr_SetFromErrno(PyExc_RuntimeError);      
+        goto error;
+    }
 
     // optional Device device = 1;    
     if (pbf_device_apps->device) {
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
         PyObject* py_device = PyDict_New();
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-        if (py_device == NULL) {
-            PyErr_SetFromErrno(PyExc_RuntimeError);
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+        if (py_device == NULL) {
+            PyErr_SetFromErrno(PyExc_RuntimeError);
+            goto error;
+        }
+
+        // optional bytes id = 1;
+        if (pbf_device_apps->device->has_id) {
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+            PyObject* py_value = Py_BuildValue("s#", pbf_device_apps->device->id.data, pbf_device_apps->device->id.len);
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+            if (py_value == NULL) {
+                PyErr_SetFromErrno(PyExc_RuntimeError);   
+                Py_DECREF(py_device);
+                goto error;
+            }
+            PyDict_SetItem(py_device, pbkeys[PBKEY_ID], py_value);
+            Py_DECREF(py_value);
+            if (PyErr_Occurred()) {            
+                PyErr_SetFromErrno(PyExc_RuntimeError);   
+                Py_DECREF(py_device);
+                goto error;
+            }
+        }
+
+        // optional bytes type = 2;
+        if (pbf_device_apps->device->has_type) {
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+            PyObject* py_value = pbstrcache_get(pbf_device_apps->device->type.data, pbf_device_apps->device->type.len);
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+            if (py_value == NULL) {
+                PyErr_SetFromErrno(PyExc_RuntimeError);   
+                Py_DECREF(py_device);
+                goto error;
+            }
+            PyDict_SetItem(py_device, pbkeys[PBKEY_TYPE], py_value);
+            Py_DECREF(py_value);
+            if (PyErr_Occurred()) {            
+                PyErr_SetFromErrno(PyExc_RuntimeError);   
+                Py_DECREF(py_device);
+                goto error;
+            }
+        }
+        PyDict_SetItem(py_device_apps, pbkeys[PBKEY_DEVICE], py_device);
+        Py_DECREF(py_device);
+        if (PyErr_Occurred()) {            
+            PyErr_SetFromErrno(PyExc_RuntimeError);   
+            goto error;
+        }
+
+    }
+
+    // repeated uint32 apps = 2;
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    PyObject* py_apps = PyList_New(pbf_device_apps->n_apps);
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    if (py_apps == NULL) {            
+        PyErr_SetFromErrno(PyExc_RuntimeError);        
+        goto error;
+    }    
+    if (pbf_device_apps->n_apps) {
+        for (size_t i = 0; i < pbf_device_apps->n_apps; i++) {
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+            PyObject* py_value = PyLong_FromLong(pbf_device_apps->apps[i]);
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+            if (py_value == NULL) {            
+                PyErr_SetFromErrno(PyExc_RuntimeError);        
+                Py_DECREF(py_apps);
+                goto error;
+            }
+            PyList_SET_ITEM(py_apps, i, py_value);
+        }
+    }
+    PyDict_SetItem(py_device_apps, pbkeys[PBKEY_APPS], py_apps);
+    Py_DECREF(py_apps);
+
+    // optional double lat = 3;
+    if (pbf_device_apps->has_lat) {
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+        PyObject* py_value = PyFloat_FromDouble(pbf_device_apps->lat);
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+        if (py_value == NULL) {            
+            PyErr_SetFromErrno(PyExc_RuntimeError);      
+            goto error;
+        }
+        PyDict_SetItem(py_device_apps, pbkeys[PBKEY_LAT], py_value);
+        Py_DECREF(py_value);
+        if (PyErr_Occurred()) {            
+            PyErr_SetFromErrno(PyExc_RuntimeError);        
+            goto error;
+        }
+    }
+
+    // optional double lon = 4;
+    if (pbf_device_apps->has_lon) {
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+        PyObject* py_value = PyFloat_FromDouble(pbf_device_apps->lon);
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+        if (py_value == NULL) {            
+            PyErr_SetFromErrno(PyExc_RuntimeError);      
+            goto error;
+        }
+        PyDict_SetItem(py_device_apps, pbkeys[PBKEY_LON], py_value);
+        Py_DECREF(py_value);
+        if (PyErr_Occurred()) {
+            PyErr_SetFromErrno(PyExc_RuntimeError);        
+            goto error;
+        }
+    }
+
+    return py_device_apps;
+
+error:
+    Py_XDECREF(py_device_apps);
+    return NULL;
+}
+
+
+// Read varint at *pos (not beyond end) and advance *pos.
+// Return 0 on truncated or too long (over 10 bytes) varint.
+static inline int get_varint(const uint8_t** pos, const uint8_t* end, uint64_t* value) {
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64 && *pos < end; shift += 7) {
+        uint8_t byte = *(*pos)++;
+        result |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static inline int get_fixed64(const uint8_t** pos, const uint8_t* end, double* value) {
+    if (end - *pos < 8)
+        return 0;
+    uint64_t bits = 0;
+    for (int i = 0; i < 8; i++)
+        bits |= (uint64_t)(*pos)[i] << (8 * i);
+    memcpy(value, &bits, sizeof(bits));
+    *pos += 8;
+    return 1;
+}
+
+// Read length of length-delimited field and check that its content fits to [*pos, end).
+static inline int get_length(const uint8_t** pos, const uint8_t* end, size_t* len) {
+    uint64_t value;
+    if (!get_varint(pos, end, &value) || value > (uint64_t)(end - *pos))
+        return 0;
+    *len = (size_t)value;
+    return 1;
+}
+
+// Skip value of unknown field. Groups (deprecated wire types 3, 4) are not supported.
+static int skip_field(const uint8_t** pos, const uint8_t* end, int wire_type) {
+    uint64_t value;
+    size_t len;
+    switch (wire_type) {
+        case WIRE_VARINT:
+            return get_varint(pos, end, &value);
+        case WIRE_FIXED64:
+            len = 8;
+            break;
+        case WIRE_LENGTH_DELIMITED:
+            if (!get_length(pos, end, &len))
+                return 0;
+            break;
+        case WIRE_FIXED32:
+            len = 4;
+            break;
+        default:
+            return 0;
+    }
+    if ((size_t)(end - *pos) < len)
+        return 0;
+    *pos += len;
+    return 1;
+}
+
+// Parse DeviceApps.Device message into view (repeated occurrences are merged).
+// Return 0 on success and 1 on malformed message.
+static int device_parse(device_apps_view_t* view, const uint8_t* pos, const uint8_t* end) {
+    while (pos < end) {
+        uint64_t key;
+        if (!get_varint(&pos, end, &key))
+            return 1;
+        uint64_t field = key >> 3;
+        int wire_type = key & 0x07;
+        if (field == 1 || field == 2) {
+            // optional bytes id = 1; optional bytes type = 2;
+            size_t len;
+            if (wire_type != WIRE_LENGTH_DELIMITED || !get_length(&pos, end, &len))
+                return 1;
+            if (field == 1) {
+                view->has_device_id = 1;
+                view->device_id = pos;
+                view->device_id_len = len;
+            } else {
+                view->has_device_type = 1;
+                view->device_type = pos;
+                view->device_type_len = len;
+            }
+            pos += len;
+        } else if (field == 0 || !skip_field(&pos, end, wire_type))
+            return 1;
+    }
+    return 0;
+}
+
+// Parse DeviceApps wire format in a single pass and append it to batch as a view
+// (header_size of its record is kept for raw records). Both unpacked and packed apps are accepted.
+// Return 0 on success, 1 on malformed message and -1 on memory error (no Python exception is set).
+static int device_apps_parse(const uint8_t* data, size_t length, size_t header_size, device_apps_batch_t* batch) {
+    // every app takes at least one byte, so length is enough for all of them
+    // (one more keeps the buffer allocated for empty messages, which come first in a batch)
+    device_apps_view_t* view = pbscratch_reserve(&batch->views, (batch->n_views + 1) * sizeof(device_apps_view_t));
+    uint32_t* apps = pbscratch_reserve(&batch->apps, (batch->n_apps + length + 1) * sizeof(uint32_t));
+    if (!view || !apps)
+        return -1;
+    view += batch->n_views;
+    memset(view, 0, sizeof(device_apps_view_t));
+    view->data = data;
+    view->length = length;
+    view->header_size = header_size;
+    view->apps_offset = batch->n_apps;
+    apps += batch->n_apps;
+
+    const uint8_t* pos = data;
+    const uint8_t* end = data + length;
+    size_t n_apps = 0;
+    while (pos < end) {
+        uint64_t key;
+        if (!get_varint(&pos, end, &key))
+            return 1;
+        uint64_t field = key >> 3;
+        int wire_type = key & 0x07;
+        size_t len;
+        uint64_t app;
+        switch (field) {
+            case 1:  // optional Device device = 1;
+                if (wire_type != WIRE_LENGTH_DELIMITED || !get_length(&pos, end, &len))
+                    return 1;
+                view->has_device = 1;
+                if (device_parse(view, pos, pos + len))
+                    return 1;
+                pos += len;
+                break;
+            case 2:  // repeated uint32 apps = 2;
+                if (wire_type == WIRE_VARINT) {
+                    if (!get_varint(&pos, end, &app))
+                        return 1;
+                    apps[n_apps++] = (uint32_t)app;
+                } else if (wire_type == WIRE_LENGTH_DELIMITED) {
+                    if (!get_length(&pos, end, &len))
+                        return 1;
+                    const uint8_t* packed_end = pos + len;
+                    while (pos < packed_end) {
+                        if (!get_varint(&pos, packed_end, &app))
+                            return 1;
+                        apps[n_apps++] = (uint32_t)app;
+                    }
+                } else
+                    return 1;
+                break;
+            case 3:  // optional double lat = 3;
+                if (wire_type != WIRE_FIXED64 || !get_fixed64(&pos, end, &view->lat))
+                    return 1;
+                view->has_lat = 1;
+                break;
+            case 4:  // optional double lon = 4;
+                if (wire_type != WIRE_FIXED64 || !get_fixed64(&pos, end, &view->lon))
+                    return 1;
+                view->has_lon = 1;
+                break;
+            default:
+                if (field == 0 || !skip_field(&pos, end, wire_type))
+                    return 1;
+        }
+    }
+    view->n_apps = n_apps;
+    batch->n_apps += n_apps;
+    batch->n_views++;
+    return 0;
+}
+
+// Append record of another type than DeviceApps to batch as a view of its message only, for raw reading.
+// Return 0 on success or -1 on memory error.
+static int device_apps_parse_raw(const uint8_t* data, size_t length, size_t header_size, device_apps_batch_t* batch) {
+    device_apps_view_t* view = pbscratch_reserve(&batch->views, (batch->n_views + 1) * sizeof(device_apps_view_t));
+    if (!view)
+        return -1;
+    view += batch->n_views++;
+    memset(view, 0, sizeof(device_apps_view_t));
+    view->data = data;
+    view->length = length;
+    view->header_size = header_size;
+    view->apps_offset = batch->n_apps;
+    return 0;
+}
+
+// Recovery reading (deviceapps_xread_pb(recover=True)): a malformed record (wrong magic or checksum,
+// message that does not parse) is skipped by scanning forward for the next record, so damage loses only
+// the records it hits. MAGIC may as well occur inside of messages, so scanning resyncs only on a header
+// with checksum (PBHEADER_CRC) matching its message: files written without checksum=True lose the rest
+// of file. All bytes passed over are counted, records as the malformed one and checksummed headers
+// passed over after it (records lost in the damaged span, headers destroyed by damage are not seen).
+typedef struct pbrecovery_s {
+    Py_ssize_t records;
+    Py_ssize_t bytes;
+} pbrecovery_t;
+
+// Return offset of the next record of data[from, size) with valid checksum, or of an incomplete one
+// (or MAGIC prefix) at the end of data unless data is final (ends the file), size if there is none.
+// Add number of checksummed headers passed over to *passed unless it is NULL.
+static size_t pbrecovery_next_record(const uint8_t* data, size_t size, size_t from, int final, Py_ssize_t* passed) {
+    static const uint8_t magic[4] = {0xff, 0xff, 0xff, 0xff};
+    for (size_t pos = from; pos < size; pos++) {
+        const uint8_t* found = memchr(data + pos, 0xff, size - pos);
+        if (!found)
+            break;
+        pos = found - data;
+        size_t n = size - pos < sizeof(magic) ? size - pos : sizeof(magic);
+        if (memcmp(data + pos, magic, n))
+            continue;
+        size_t length;
+        Py_ssize_t header_size = pbheader_get(data + pos, size - pos, &length);
+        if (header_size == 0) {
+            if (!final)
+                return pos;
+        } else if (header_size > 0 && pbheader_has_crc(data + pos)) {
+            if (size - pos - header_size < length) {
+                if (!final)
+                    return pos;
+            } else if (pbheader_check(data + pos, header_size, length)) {
+                return pos;
+            }
+            if (passed)
+                (*passed)++;
+        }
+    }
+    return size;
+}
+
+// Skip malformed record at data[pos] up to the next record (see pbrecovery_next_record) and count it.
+// Return offset of the next record.
+static size_t pbrecovery_skip(pbrecovery_t* recovery, const uint8_t* data, size_t size, size_t pos, int final) {
+    Py_ssize_t passed = 0;
+    size_t next = pbrecovery_next_record(data, size, pos + 1, final, &passed);
+    recovery->records += 1 + passed;
+    recovery->bytes += next - pos;
+    return next;
+}
+
+// Parse consecutive records (header + DeviceApps) of data into batch, records of types not in types
+// are skipped, those of other types than DeviceApps are added as raw views (see device_apps_parse_raw).
+// Parsing stops at the first incomplete record, *consumed is set to the size of parsed records
+// (and skipped bytes if recovery is not NULL, then malformed records are skipped, not reported).
+// Return 0 on success, 1 on malformed record (at *consumed) and -1 on memory error.
+static int device_apps_parse_records(const uint8_t* data, size_t size, device_apps_batch_t* batch, size_t* consumed,
+                                     const pbtypes_t* types, pbrecovery_t* recovery) {
+    PBSTATS_START(started);
+    PBSTATS_RECORDS(parsed_records);
+    size_t pos = 0;
+    int rc = 0;
+    size_t length;
+    Py_ssize_t header_size;
+    while ((header_size = pbheader_get(data + pos, size - pos, &length))) {
+        int incomplete = header_size > 0 && size - pos - header_size < length;
+        // recovery does not wait for the rest of record whose (wide) length is broken, as a valid record
+        // starting inside of it tells, else damaged length would buffer up to the rest of file
+        if (incomplete && (!recovery || pbrecovery_next_record(data, size, pos + 1, 1, NULL) == size))
+            break;
+        uint16_t type = header_size > 0 ? pbheader_type(data + pos) : 0;
+        int wanted = header_size > 0 && pbtypes_has(types, type);
+        // recovery checks also records it skips, their length may be broken
+        if (header_size < 0 || incomplete || ((wanted || recovery) && !pbheader_check(data + pos, header_size, length)))
+            rc = 1;
+        else if (!wanted) {
+            pos += header_size + length;
+            continue;
+        } else if (is_device_apps_type(type))
+            rc = device_apps_parse(data + pos + header_size, length, header_size, batch);
+        else
+            rc = device_apps_parse_raw(data + pos + header_size, length, header_size, batch);
+        if (rc > 0 && recovery) {
+            pos = pbrecovery_skip(recovery, data, size, pos, 0);
+            rc = 0;
+            continue;
+        }
+        if (rc)
+            break;
+        PBSTATS_RECORD(parsed_records, header_size + length);
+        pos += header_size + length;
+    }
+    *consumed = pos;
+    PBSTATS_MERGE(parsed, parsed_records);
+    PBSTATS_STOP(PBSTAGE_PARSE, started);
+    return rc;
+}
+
+// Store a new reference under one of pbkeys, which is released (also if py_value is NULL on error).
+static int set_item(PyObject* py_dict, int key, PyObject* py_value) {
+    if (py_value == NULL)
+        return -1;
+    int rc = PyDict_SetItem(py_dict, pbkeys[key], py_value);
+    Py_DECREF(py_value);
+    return rc;
+}
+
+// Build Python dict of parsed record, apps are the apps of its batch.
+// Return new reference or NULL on error (with Python exception set).
+static PyObject* device_apps_build(const device_apps_view_t* view, const uint32_t* apps) {
+    PyObject* py_device_apps = PyDict_New();
+    if (py_device_apps == NULL)
+        return NULL;
+    // keys go in the same order as deserialize() puts them
+    if (view->has_device) {
+        PyObject* py_device = PyDict_New();
+        if (py_device == NULL)
+            goto error;
+        int rc = (view->has_device_id && set_item(py_device, PBKEY_ID, PyUnicode_FromStringAndSize(
+                      (const char*)view->device_id, view->device_id_len)) < 0)
+            || (view->has_device_type && set_item(py_device, PBKEY_TYPE,
+                                                  pbstrcache_get(view->device_type, view->device_type_len)) < 0)
+            || PyDict_SetItem(py_device_apps, pbkeys[PBKEY_DEVICE], py_device) < 0;
+        Py_DECREF(py_device);
+        if (rc)
+            goto error;
+    }
+    PyObject* py_apps = PyList_New(view->n_apps);
+    if (py_apps == NULL)
+        goto error;
+    for (size_t i = 0; i < view->n_apps; i++) {
+        PyObject* py_value = PyLong_FromUnsignedLong(apps[view->apps_offset + i]);
+        if (py_value == NULL) {
+            Py_DECREF(py_apps);
+            goto error;
+        }
+        PyList_SET_ITEM(py_apps, i, py_value);
+    }
+    if (set_item(py_device_apps, PBKEY_APPS, py_apps) < 0)
+        goto error;
+    if (view->has_lat && set_item(py_device_apps, PBKEY_LAT, PyFloat_FromDouble(view->lat)) < 0)
+        goto error;
+    if (view->has_lon && set_item(py_device_apps, PBKEY_LON, PyFloat_FromDouble(view->lon)) < 0)
+        goto error;
+    return py_device_apps;
+
+error:
+    Py_DECREF(py_device_apps);
+    return NULL;
+}
+
+// Parallel reader of multi-member gzip files (output of threads > 1 writer, cat a.gz b.gz, ...).
+// The main thread scans compressed input for gzip member headers and hands every member
+// (all bytes up to the next candidate header) to a worker, which inflates it
+// and parses its records into a batch of views. The main thread only builds the dicts, in order.
+// Memory is bounded by the job ring: at most 2 * threads members are in flight.
+// A member normally holds whole records; otherwise records of consecutive members
+// are joined and parsed by the main thread.
+// A candidate header inside compressed data (inflate does not end exactly at the next candidate),
+// or a member longer than PBSEGMENT_MAX makes the reader continue sequentially with gzread from that member.
+#define PBSCAN_CHUNK (1024 * 1024)
+#define PBSEGMENT_MAX (8 * 1024 * 1024)
+#define GZIP_HEADER_MIN_SIZE 10
+
+typedef struct pbinflate_job_s {
+    pbjob_t job;
+    pbscratch_t input;
+    size_t input_size;
+    off_t offset;  // of member in file
+    pbscratch_t output;
+    size_t output_size;
+    device_apps_batch_t batch;
+    const pbtypes_t* types;  // of reader
+    int parsed;  // output is made of whole valid records, all of them are in batch
+} pbinflate_job_t;
+
+static void* pbinflate_worker_init(const void* arg) {
+    z_stream* strm = calloc(1, sizeof(z_stream));
+    if (strm && inflateInit2(strm, 15 + 16) != Z_OK) {
+        free(strm);
+        return NULL;
+    }
+    return strm;
+}
+
+static void pbinflate_worker_free(void* ctx) {
+    inflateEnd(ctx);
+    free(ctx);
+}
+
+// Inflate exactly one gzip member of job input, then parse its records.
+static int pbinflate_run(pbjob_t* job, void* ctx) {
+    pbinflate_job_t* member = (pbinflate_job_t*)job;
+    z_stream* strm = ctx;
+    size_t output_size = 0;
+    int rc = Z_OK;
+    PBSTATS_START(started);
+    inflateReset(strm);
+    strm->next_in = member->input.data;
+    strm->avail_in = member->input_size;
+    while (rc == Z_OK) {
+        uint8_t* output = pbscratch_reserve(&member->output, output_size + 4 * member->input_size + 4096);
+        if (!output)
+            return JOB_FAILED;
+        strm->next_out = output + output_size;
+        strm->avail_out = member->output.size - output_size;
+        rc = inflate(strm, Z_NO_FLUSH);
+        output_size = member->output.size - strm->avail_out;
+        if (rc == Z_BUF_ERROR && strm->avail_out == 0)
+            rc = Z_OK;  // just out of room
+    }
+    PBSTATS_STOP(PBSTAGE_READ, started);
+    if (rc != Z_STREAM_END || strm->avail_in)
+        return JOB_FAILED;
+    member->output_size = output_size;
+
+    size_t consumed;
+    device_apps_batch_reset(&member->batch);
+    member->parsed = !device_apps_parse_records(member->output.data, output_size, &member->batch, &consumed,
+                                                member->types, NULL)
+        && consumed == output_size;
+    return JOB_DONE;
+}
+
+static void pbinflate_job_free(pbjob_t* job) {
+    pbinflate_job_t* member = (pbinflate_job_t*)job;
+    pbscratch_free(&member->input);
+    pbscratch_free(&member->output);
+    device_apps_batch_free(&member->batch);
+}
+
+typedef struct pbinflate_reader_s {
+    FILE* file;
+    pbpool_t pool;
+    pbscratch_t scan;  // compressed input read ahead
+    size_t scan_size;
+    size_t scan_pos;  // next position to look for member header at
+    size_t segment;  // start of member not submitted yet
+    off_t scan_offset;  // of scan buffer in file
+    int eof;
+    off_t fallback_offset;  // where sequential reading continues from after submitted members, -1 if nowhere
+    int job_held;  // oldest job is being consumed
+    const pbtypes_t* types;  // wanted, owned by iterator
+} pbinflate_reader_t;
+
+// RFC 1952: ID1 ID2 CM=8 FLG (reserved bits zero) MTIME(4) XFL OS
+static inline int is_gzip_header(const uint8_t* p) {
+    return p[0] == 0x1f && p[1] == 0x8b && p[2] == 8 && !(p[3] & 0xE0) && (p[8] == 0 || p[8] == 2 || p[8] == 4)
+        && (p[9] <= 13 || p[9] == 255);
+}
+
+// Submit members found in read ahead input until the job ring is full, input ends,
+// or sequential fallback is needed. Return 0 on success or -1 on I/O error (with Python exception set).
+static int pbinflate_fill(pbinflate_reader_t* reader) {
+    pbpool_t* pool = &reader->pool;
+    while (pool->submitted - pool->completed < pool->n_jobs && reader->fallback_offset < 0
+           && !(reader->eof && reader->segment == reader->scan_size)) {
+        uint8_t* scan = reader->scan.data;
+        if (reader->segment == reader->scan_pos && reader->scan_pos < reader->scan_size) {
+            if (reader->scan_size - reader->scan_pos < GZIP_HEADER_MIN_SIZE && !reader->eof)
+                goto read_more;
+            if (reader->scan_size - reader->scan_pos < GZIP_HEADER_MIN_SIZE || !is_gzip_header(scan + reader->scan_pos)) {
+                // not a gzip member where one is expected
+                reader->fallback_offset = reader->scan_offset + reader->segment;
+                break;
+            }
+            reader->scan_pos++;
+        }
+        while (reader->scan_pos + GZIP_HEADER_MIN_SIZE <= reader->scan_size && !is_gzip_header(scan + reader->scan_pos))
+            reader->scan_pos++;
+        if (reader->scan_pos + GZIP_HEADER_MIN_SIZE > reader->scan_size) {
+            if (!reader->eof)
+                goto read_more;
+            reader->scan_pos = reader->scan_size;
+        }
+        if (reader->scan_pos - reader->segment > PBSEGMENT_MAX) {
+            reader->fallback_offset = reader->scan_offset + reader->segment;
+            break;
+        }
+
+        pbinflate_job_t* job = (pbinflate_job_t*)pbpool_job(pool, pool->submitted);
+        size_t size = reader->scan_pos - reader->segment;
+        if (!pbscratch_reserve(&job->input, size)) {
+            PyErr_SetString(PyExc_MemoryError, "Memory error.");
+            return -1;
+        }
+        memcpy(job->input.data, scan + reader->segment, size);
+        job->input_size = size;
+        job->offset = reader->scan_offset + reader->segment;
+        job->types = reader->types;
+        reader->segment = reader->scan_pos;
+        pbpool_submit(pool);
+        continue;
+
+read_more:
+        if (reader->scan_size - reader->segment > PBSEGMENT_MAX) {
+            reader->fallback_offset = reader->scan_offset + reader->segment;
+            break;
+        }
+        // drop submitted input, then read next chunk
+        if (reader->segment) {
+            memmove(scan, scan + reader->segment, reader->scan_size - reader->segment);
+            reader->scan_offset += reader->segment;
+            reader->scan_size -= reader->segment;
+            reader->scan_pos -= reader->segment;
+            reader->segment = 0;
+        }
+        scan = pbscratch_reserve(&reader->scan, reader->scan_size + PBSCAN_CHUNK);
+        if (!scan) {
+            PyErr_SetString(PyExc_MemoryError, "Memory error.");
+            return -1;
+        }
+        size_t bytes_read;
+        Py_BEGIN_ALLOW_THREADS
+        PBSTATS_START(started);
+        bytes_read = fread(scan + reader->scan_size, 1, PBSCAN_CHUNK, reader->file);
+        PBSTATS_ADD(bytes_read, bytes_read);
+        PBSTATS_STOP(PBSTAGE_READ, started);
+        Py_END_ALLOW_THREADS
+        if (bytes_read < PBSCAN_CHUNK) {
+            if (ferror(reader->file)) {
+                PyErr_SetString(PyExc_OSError, "File read failed.");
+                return -1;
+            }
+            reader->eof = 1;
+        }
+        reader->scan_size += bytes_read;
+    }
+    return 0;
+}
+
+static void pbinflate_reader_free(pbinflate_reader_t* reader) {
+    pbpool_destroy(&reader->pool);
+    pbscratch_free(&reader->scan);
+    if (reader->file)
+        fclose(reader->file);
+    free(reader);
+}
+
+// Sequential reader of concatenated frames of a codec with stream decompression (zstd, lz4),
+// which stands in for gzFile. Touches no Python objects.
+#define PBDECODER_CHUNK (256 * 1024)
+
+typedef struct pbdecoder_s {
+    const pbcodec_t* codec;
+    void* ddict;
+    void* dctx;
+    FILE* file;
+    pbscratch_t input;
+    size_t input_pos;
+    size_t input_size;
+    int eof;
+    int in_frame;  // decompressed data so far ends inside of a frame
+} pbdecoder_t;
+
+static void pbdecoder_free(pbdecoder_t* decoder) {
+    if (decoder->dctx)
+        decoder->codec->dctx_free(decoder->dctx);
+    if (decoder->ddict)
+        decoder->codec->ddict_free(decoder->ddict);
+    if (decoder->file)
+        fclose(decoder->file);
+    pbscratch_free(&decoder->input);
+    free(decoder);
+}
+
+// Digest dictionary (NULL if not given) for frames of codec at offset of fd into *ddict,
+// which stays NULL if frames are compressed without dictionary.
+// Return 0 on success or -1 if frames need another dictionary (with Python exception set).
+static int pbdecoder_load_dictionary(const pbcodec_t* codec, int fd, off_t offset, const Py_buffer* dictionary, void** ddict) {
+    *ddict = NULL;
+    if (!codec->ddict_new)
+        return 0;
+    uint8_t frame[32];  // > frame header
+    ssize_t frame_size = pread(fd, frame, sizeof(frame), offset);
+    uint32_t id = codec->frame_dict_id(frame, frame_size > 0 ? frame_size : 0);
+    if (!id)
+        return 0;
+    if (!dictionary) {
+        PyErr_Format(PyExc_ValueError, "File needs dictionary %u.", id);
+        return -1;
+    }
+    uint32_t given_id = codec->dict_id(dictionary->buf, dictionary->len);
+    if (given_id != id) {
+        PyErr_Format(PyExc_ValueError, "File needs dictionary %u, not %u.", id, given_id);
+        return -1;
+    }
+    *ddict = codec->ddict_new(dictionary->buf, dictionary->len);
+    if (!*ddict) {
+        PyErr_SetString(PyExc_MemoryError, "Memory error.");
+        return -1;
+    }
+    return 0;
+}
+
+// Return new decoder of fd with ddict (NULL or made by codec, both are owned by decoder then)
+// or NULL on error (with Python exception set).
+static pbdecoder_t* pbdecoder_new(const pbcodec_t* codec, int fd, void* ddict) {
+    pbdecoder_t* decoder = calloc(1, sizeof(pbdecoder_t));
+    if (!decoder) {
+        close(fd);
+        if (ddict)
+            codec->ddict_free(ddict);
+        PyErr_SetString(PyExc_MemoryError, "Memory error.");
+        return NULL;
+    }
+    decoder->codec = codec;
+    decoder->ddict = ddict;
+    decoder->file = fdopen(fd, "rb");
+    if (!decoder->file)
+        close(fd);
+    decoder->dctx = codec->dctx_new(ddict);
+    if (!decoder->file || !decoder->dctx) {
+        pbdecoder_free(decoder);
+        PyErr_SetString(PyExc_MemoryError, "Memory error.");
+        return NULL;
+    }
+    return decoder;
+}
+
+// Decompress up to size bytes into output.
+// Return their number, 0 on the end of file or -1 on error (malformed or truncated frame, I/O or memory error).
+static Py_ssize_t pbdecoder_read(pbdecoder_t* decoder, uint8_t* output, size_t size) {
+    uint8_t* pos = output;
+    uint8_t* end = output + size;
+    while (pos < end) {
+        const uint8_t* input = (const uint8_t*)decoder->input.data + decoder->input_pos;
+        const uint8_t* input_start = input;
+        uint8_t* output_start = pos;
+        int rc = decoder->codec->decompress(decoder->dctx, &input, (const uint8_t*)decoder->input.data + decoder->input_size,
+                                            &pos, end);
+        if (rc < 0)
+            return -1;
+        decoder->input_pos += input - input_start;
+        if (input > input_start || pos > output_start) {
+            decoder->in_frame = rc;
+            continue;
+        }
+        // no progress, more input is needed
+        if (decoder->eof)
+            break;
+        uint8_t* chunk = pbscratch_reserve(&decoder->input, PBDECODER_CHUNK);
+        if (!chunk)
+            return -1;
+        decoder->input_pos = 0;
+        decoder->input_size = fread(chunk, 1, PBDECODER_CHUNK, decoder->file);
+        PBSTATS_ADD(bytes_read, decoder->input_size);
+        if (decoder->input_size < PBDECODER_CHUNK) {
+            if (ferror(decoder->file))
+                return -1;
+            decoder->eof = 1;
+        }
+    }
+    if (pos == output && decoder->in_frame)  // file ends inside of a frame
+        return -1;
+    return pos - output;
+}
+
+// Contiguous array exported through the buffer protocol (memoryview, numpy.frombuffer, pyarrow.py_buffer).
+// Owns its malloc'ed data, or a read-only mapping of a file (bytes).
+typedef struct {
+    PyObject_HEAD
+    void* data;
+    Py_ssize_t length;
+    Py_ssize_t itemsize;
+    char format[2];
+    int mapped;
+} PbColumnObject;
+
+static void pbcolumn_dealloc(PbColumnObject* self) {
+    if (self->mapped)
+        munmap(self->data, self->length);
+    else
+        free(self->data);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static int pbcolumn_getbuffer(PbColumnObject* self, Py_buffer* view, int flags) {
+    if (self->mapped && (flags & PyBUF_WRITABLE)) {
+        PyErr_SetString(PyExc_BufferError, "Column of mapped file is read-only.");
+        view->obj = NULL;
+        return -1;
+    }
+    view->obj = (PyObject*)self;
+    Py_INCREF(self);
+    view->buf = self->data;
+    view->len = self->length * self->itemsize;
+    view->readonly = self->mapped;
+    view->itemsize = self->itemsize;
+    view->format = (flags & PyBUF_FORMAT) ? self->format : NULL;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) ? &self->length : NULL;
+    view->strides = ((flags & PyBUF_STRIDES) == PyBUF_STRIDES) ? &view->itemsize : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static Py_ssize_t pbcolumn_len(PbColumnObject* self) {
+    return self->length;
+}
+
+static PyBufferProcs PbColumnBufferProcs = {
+    .bf_getbuffer = (getbufferproc)pbcolumn_getbuffer,
+};
+
+static PySequenceMethods PbColumnSequenceMethods = {
+    .sq_length = (lenfunc)pbcolumn_len,
+};
+
+static PyTypeObject PbColumnType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "pb.Column",
+    .tp_doc = "Contiguous array of a column, use memoryview() or numpy.frombuffer() to access it",
+    .tp_basicsize = sizeof(PbColumnObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor)pbcolumn_dealloc,
+    .tp_as_buffer = &PbColumnBufferProcs,
+    .tp_as_sequence = &PbColumnSequenceMethods,
+};
+
+// Lazy iterator over DeviceApps records of a pb file, compressed by any codec (see pbcodec_t) or not.
+// Owns the gzFile and reads it by chunks of PBREAD_CHUNK bytes into carry buffer,
+// whole records of a chunk are parsed into views and turned into dicts one per next(),
+// so memory use does not depend on the file size. Buffers are reused between chunks.
+// The GIL is released while reading and parsing a chunk; a record not finished by the chunk
+// stays in carry for the next one.
+// With threads > 1 members are inflated and parsed by pbinflate_reader_t instead,
+// and gzFile is used only if the reader falls back to sequential reading.
+// zstd and lz4 files are read the same way through pbdecoder_t in place of gzFile (threads are not used).
+// An uncompressed file is mapped into memory instead and parsed in place by chunks of PBREAD_CHUNK bytes:
+// views point into the mapping, so records are neither read nor copied.
+// start/stop select a range of records: reading starts from the indexed block of start (see pbindex_entry_t)
+// or from the beginning, records before start are skipped without building dicts (just by headers if mapped).
+// raw=True yields framed records (pbheader_t + message) instead of dicts: memoryview slices of the mapping
+// for uncompressed file, bytes otherwise.
+// Records of types not wanted (see pbtypes_t) are skipped by their headers. Sequential reading does not
+// keep one that goes on past the chunk: the rest of it is read and dropped (discard).
+// Build with -DPB_VALIDATE_DECODER to check every record against protobuf-c decoder
+// (unpacked into reusable arena) + deserialize().
+#define PBREAD_CHUNK (256 * 1024)
+
+typedef struct {
+    PyObject_HEAD
+    gzFile zfile;
+    pbdecoder_t* decoder;
+    device_apps_batch_t batch;
+    pbinflate_reader_t* reader;
+    const device_apps_batch_t* views;  // parsed records being consumed
+    size_t view_index;
+    int views_error;  // malformed record follows views
+    pbscratch_t carry;
+    size_t carry_start;
+    size_t carry_size;
+    PbColumnObject* map;  // uncompressed file
+    PyObject* map_view;  // memoryview of map, sliced for raw records
+    size_t map_pos;  // next record to parse
+    size_t skip;  // records to skip before start
+    size_t remaining;  // records to read before stop
+    int raw;
+    pbtypes_t* types;  // wanted, NULL for DeviceApps ones
+    size_t discard;  // bytes of unwanted record to drop from what is read next
+    int recover;  // skip malformed records, see pbrecovery_t
+    pbrecovery_t recovery;
+    int busy;  // next() runs, possibly with the GIL released
+#ifdef PB_VALIDATE_DECODER
+    pbarena_t arena;
+    ProtobufCAllocator allocator;
+#endif
+} DeviceAppsIterObject;
+
+static void deviceapps_iter_close_file(DeviceAppsIterObject* self) {
+    if (self->zfile) {
+        gzclose(self->zfile);
+        self->zfile = NULL;
+    }
+    if (self->decoder) {
+        pbdecoder_free(self->decoder);
+        self->decoder = NULL;
+    }
+    if (self->reader) {
+        pbinflate_reader_free(self->reader);
+        self->reader = NULL;
+    }
+    Py_CLEAR(self->map_view);
+    Py_CLEAR(self->map);
+    self->views = NULL;
+    self->views_error = 0;
+    pbscratch_free(&self->carry);
+    self->carry_start = self->carry_size = 0;
+    device_apps_batch_free(&self->batch);
+#ifdef PB_VALIDATE_DECODER
+    pbarena_destroy(&self->arena);
+#endif
+}
+
+static void deviceapps_iter_dealloc(DeviceAppsIterObject* self) {
+    deviceapps_iter_close_file(self);
+    free(self->types);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+// Stop parallel reading and continue sequentially from offset (a member start) of the file.
+// Return 0 on success or -1 on error (with Python exception set).
+static int deviceapps_iter_fallback(DeviceAppsIterObject* self, off_t offset) {
+    int fd = dup(fileno(self->reader->file));
+    pbinflate_reader_free(self->reader);
+    self->reader = NULL;
+    if (fd >= 0 && lseek(fd, offset, SEEK_SET) == offset)
+        self->zfile = gzdopen(fd, "rb");
+    if (!self->zfile) {
+        if (fd >= 0)
+            close(fd);
+        PyErr_SetString(PyExc_OSError, "gzdopen failed.");
+        return -1;
+    }
+    return 0;
+}
+
+// Drop consumed part of carry and reserve room for size more bytes after the rest.
+// Return pointer to that room or NULL on error (with Python exception set).
+static uint8_t* deviceapps_iter_carry_reserve(DeviceAppsIterObject* self, size_t size) {
+    size_t tail = self->carry_size - self->carry_start;
+    if (self->carry_start) {
+        memmove(self->carry.data, (uint8_t*)self->carry.data + self->carry_start, tail);
+        self->carry_start = 0;
+        self->carry_size = tail;
+    }
+    uint8_t* carry = pbscratch_reserve(&self->carry, tail + size);
+    if (!carry) {
+        PyErr_SetString(PyExc_MemoryError, "Memory error.");
+        return NULL;
+    }
+    return carry + tail;
+}
+
+// Parse whole records of carry into self->batch, runs without the GIL.
+static int deviceapps_iter_parse_carry(DeviceAppsIterObject* self) {
+    size_t consumed;
+    device_apps_batch_reset(&self->batch);
+    int rc = device_apps_parse_records(self->carry.data, self->carry_size, &self->batch, &consumed, self->types,
+                                       self->recover ? &self->recovery : NULL);
+    self->carry_start = consumed;
+    self->views = &self->batch;
+    self->view_index = 0;
+    self->views_error = rc > 0;
+    return rc;
+}
+
+// Drop incomplete record at carry_start if it is of unwanted type, its rest is dropped as it is read.
+// Recovery keeps it, its length may be broken.
+static void deviceapps_iter_discard_tail(DeviceAppsIterObject* self) {
+    const uint8_t* data = (const uint8_t*)self->carry.data + self->carry_start;
+    size_t size = self->carry_size - self->carry_start;
+    size_t length;
+    Py_ssize_t header_size = pbheader_get(data, size, &length);
+    if (header_size > 0 && !pbtypes_has(self->types, pbheader_type(data))) {
+        self->discard = header_size + length - size;
+        self->carry_size = self->carry_start;
+    }
+}
+
+// Skip incomplete record at carry_start at the end of file (malformed then) and parse the rest of carry,
+// runs without the GIL.
+static int deviceapps_iter_recover_tail(DeviceAppsIterObject* self) {
+    const uint8_t* data = self->carry.data;
+    size_t next = pbrecovery_skip(&self->recovery, data, self->carry_size, self->carry_start, 1);
+    size_t consumed;
+    device_apps_batch_reset(&self->batch);
+    int rc = device_apps_parse_records(data + next, self->carry_size - next, &self->batch, &consumed, self->types,
+                                       &self->recovery);
+    self->carry_start = next + consumed;
+    self->views = &self->batch;
+    self->view_index = 0;
+    self->views_error = 0;
+    return rc;
+}
+
+// Make the next parsed records of gzFile (or decoder) current (self->views).
+// Return 1 if there are records, 0 on the end of file and -1 on error (with Python exception set).
+static int deviceapps_iter_read_views(DeviceAppsIterObject* self) {
+    for (;;) {
+        uint8_t* chunk = deviceapps_iter_carry_reserve(self, PBREAD_CHUNK);
+        if (!chunk)
+            return -1;
+        int bytes_read, rc = 0;
+        Py_BEGIN_ALLOW_THREADS
+        PBSTATS_START(started);
+        PBSTATS_GZOFFSET(zoffset, self->zfile);
+        bytes_read = self->zfile ? gzread(self->zfile, chunk, PBREAD_CHUNK) : pbdecoder_read(self->decoder, chunk, PBREAD_CHUNK);
+        PBSTATS_ADD(bytes_read, pbstats_gzoffset(self->zfile) - zoffset);
+        PBSTATS_STOP(PBSTAGE_READ, started);
+        if (bytes_read > 0) {
+            size_t dropped = self->discard < (size_t)bytes_read ? self->discard : (size_t)bytes_read;
+            if (dropped)
+                memmove(chunk, chunk + dropped, bytes_read - dropped);
+            self->discard -= dropped;
+            self->carry_size += bytes_read - dropped;
+            rc = deviceapps_iter_parse_carry(self);
+            if (!rc && !self->recover)
+                deviceapps_iter_discard_tail(self);
+        }
+        Py_END_ALLOW_THREADS
+        if (bytes_read < 0 && !self->recover) {
+            PyErr_SetString(PyExc_ValueError, "Wrong file format.");
+            return -1;
+        }
+        if (bytes_read <= 0)  // recovery takes broken compressed stream for truncated one
+            return 0;
+        if (rc < 0) {
+            PyErr_SetString(PyExc_MemoryError, "Memory error.");
+            return -1;
+        }
+        if (self->views->n_views || self->views_error)
+            return 1;
+        // record is longer than the chunk
+    }
+}
+
+// Make the next parsed records of mapped file current (self->views), they point into the mapping.
+// Return 1 if there are records, 0 on the end of file and -1 on error (with Python exception set).
+static int deviceapps_iter_map_views(DeviceAppsIterObject* self) {
+    const uint8_t* data = (const uint8_t*)self->map->data + self->map_pos;
+    size_t rest = self->map->length - self->map_pos;
+    if (!rest)
+        return 0;
+    size_t consumed;
+    int rc;
+    Py_BEGIN_ALLOW_THREADS
+    device_apps_batch_reset(&self->batch);
+    pbrecovery_t* recovery = self->recover ? &self->recovery : NULL;
+    rc = device_apps_parse_records(data, rest < PBREAD_CHUNK ? rest : PBREAD_CHUNK, &self->batch, &consumed,
+                                   self->types, recovery);
+    if (!rc && !consumed)  // record is longer than the chunk
+        rc = device_apps_parse_records(data, rest, &self->batch, &consumed, self->types, recovery);
+    if (!rc && !consumed && recovery) {
+        // file ends inside of record, which is malformed then
+        consumed = pbrecovery_skip(recovery, data, rest, 0, 1);
+    }
+    Py_END_ALLOW_THREADS
+    if (rc < 0) {
+        PyErr_SetString(PyExc_MemoryError, "Memory error.");
+        return -1;
+    }
+    self->map_pos += consumed;
+    PBSTATS_ADD(bytes_read, consumed);
+    self->views = &self->batch;
+    self->view_index = 0;
+    self->views_error = rc > 0 || !consumed;  // malformed record or file ends inside of record
+    return 1;
+}
+
+// Make the next parsed records current (self->views) in parallel mode.
+// Return 1 if there are records, 0 if parallel reading is over (it may go on sequentially) and -1 on error.
+static int deviceapps_iter_next_views(DeviceAppsIterObject* self) {
+    pbinflate_reader_t* reader = self->reader;
+    pbpool_t* pool = &reader->pool;
+    for (;;) {
+        if (reader->job_held) {
+            pbpool_release(pool);
+            reader->job_held = 0;
+        }
+        if (pbinflate_fill(reader) < 0)
+            return -1;
+        if (pool->completed == pool->submitted) {
+            if (reader->fallback_offset >= 0)
+                return deviceapps_iter_fallback(self, reader->fallback_offset);
+            pbinflate_reader_free(reader);
+            self->reader = NULL;
+            return 0;
+        }
+        pbinflate_job_t* job;
+        Py_BEGIN_ALLOW_THREADS
+        job = (pbinflate_job_t*)pbpool_wait(pool);
+        Py_END_ALLOW_THREADS
+        if (job->job.state == JOB_FAILED)
+            return deviceapps_iter_fallback(self, job->offset);
+        if (job->parsed && self->carry_start == self->carry_size) {
+            reader->job_held = 1;
+            self->views = &job->batch;
+            self->view_index = 0;
+            self->views_error = 0;
+        } else {
+            // member does not start or end at record boundary, join it with the rest of previous one
+            uint8_t* output = deviceapps_iter_carry_reserve(self, job->output_size);
+            if (!output)
+                return -1;
+            int rc;
+            Py_BEGIN_ALLOW_THREADS
+            memcpy(output, job->output.data, job->output_size);
+            self->carry_size += job->output_size;
+            rc = deviceapps_iter_parse_carry(self);
+            Py_END_ALLOW_THREADS
+            pbpool_release(pool);
+            if (rc < 0) {
+                PyErr_SetString(PyExc_MemoryError, "Memory error.");
+                return -1;
+            }
+        }
+        if (self->views->n_views || self->views_error)
+            return 1;
+    }
+}
+
+// Make the next parsed records current (self->views), reading further if needed.
+// Return 1 if there are records, 0 on the end of file and -1 on error (with Python exception set),
+// the file is closed in both last cases.
+static int deviceapps_iter_advance(DeviceAppsIterObject* self) {
+    for (;;) {
+        if (!self->remaining) {
+            deviceapps_iter_close_file(self);
+            return 0;
+        }
+        if (self->views && self->view_index < self->views->n_views) {
+            if (!self->skip)
+                return 1;
+            size_t n = self->views->n_views - self->view_index;
+            n = n < self->skip ? n : self->skip;
+            self->view_index += n;
+            self->skip -= n;
+            continue;
+        }
+        if (self->views && self->views_error) {
+            PyErr_SetString(PyExc_ValueError, "Wrong file format.");
+            goto error;
+        }
+        self->views = NULL;
+
+        int rc;
+        if (self->reader)
+            rc = deviceapps_iter_next_views(self);
+        else if (self->map) {
+            rc = deviceapps_iter_map_views(self);
+            if (rc == 0) {
+                Py_CLEAR(self->map_view);
+                Py_CLEAR(self->map);
+            }
+        } else if (self->zfile || self->decoder) {
+            rc = deviceapps_iter_read_views(self);
+            if (rc == 0 && self->zfile) {
+                gzclose(self->zfile);
+                self->zfile = NULL;
+            } else if (rc == 0) {
+                pbdecoder_free(self->decoder);
+                self->decoder = NULL;
+            }
+        } else if (self->recover && self->carry_start < self->carry_size) {
+            Py_BEGIN_ALLOW_THREADS
+            rc = deviceapps_iter_recover_tail(self);
+            Py_END_ALLOW_THREADS
+            if (rc < 0) {
+                PyErr_SetString(PyExc_MemoryError, "Memory error.");
+                goto error;
+            }
+        } else {
+            if (self->carry_start == self->carry_size && !self->discard) {
+                deviceapps_iter_close_file(self);
+                return 0;
+            }
+            // file ends inside of record
+            PyErr_SetString(PyExc_ValueError, "Wrong file format.");
+            goto error;
+        }
+        if (rc < 0)
             goto error;
+    }
+
+error:
+    deviceapps_iter_close_file(self);
+    return -1;
+}
+
+// Return framed record (header + message) of view: memoryview slice of mapped file or bytes.
+static PyObject* deviceapps_iter_raw_record(DeviceAppsIterObject* self, const device_apps_view_t* view) {
+    const uint8_t* record = view->data - view->header_size;
+    size_t size = view->length + view->header_size;
+    if (!self->map)
+        return PyBytes_FromStringAndSize((const char*)record, size);
+    if (!self->map_view && !(self->map_view = PyMemoryView_FromObject((PyObject*)self->map)))
+        return NULL;
+    Py_ssize_t start = record - (const uint8_t*)self->map->data;
+    return PySequence_GetSlice(self->map_view, start, start + size);
+}
+
+// Return next record as Python dict (or raw record) or NULL on error or the end of file (then file is closed).
+static PyObject* deviceapps_iter_next_record(DeviceAppsIterObject* self) {
+    if (deviceapps_iter_advance(self) <= 0)
+        return NULL;
+    const device_apps_view_t* view = (const device_apps_view_t*)self->views->views.data + self->view_index++;
+    self->remaining--;
+    if (self->raw) {
+        PyObject* py_record = deviceapps_iter_raw_record(self, view);
+        if (py_record == NULL)
+            deviceapps_iter_close_file(self);
+        return py_record;
+    }
+    PBSTATS_START(started);
+    PyObject* py_msg = device_apps_build(view, self->views->apps.data);
+    PBSTATS_STOP(PBSTAGE_BUILD, started);
+    PBSTATS_ADD(built, 1);
+#ifdef PB_VALIDATE_DECODER
+    // message lives in arena, so there is no device_apps__free_unpacked, just reset
+    pbarena_reset(&self->arena);
+    DeviceApps* msg = device_apps__unpack(&self->allocator, view->length, view->data);
+    PyObject* py_reference = msg ? deserialize(msg) : NULL;
+    int equal = (py_msg && py_reference) ? PyObject_RichCompareBool(py_msg, py_reference, Py_EQ) : (!py_msg && !msg);
+    Py_XDECREF(py_reference);
+    if (equal != 1) {
+        Py_XDECREF(py_msg);
+        if (equal == 0)
+            PyErr_SetString(PyExc_RuntimeError, "DeviceApps decoder output differs from protobuf-c.");
+        py_msg = NULL;
+    }
+#endif
+    if (py_msg == NULL)
+        deviceapps_iter_close_file(self);
+    return py_msg;
+}
+
+// Return next record as Python dict.
+// NULL without exception set means the end of file (StopIteration), the file is closed then.
+static PyObject* deviceapps_iter_next(DeviceAppsIterObject* self) {
+    if (self->busy) {
+        PyErr_SetString(PyExc_ValueError, "DeviceAppsIterator already executing.");
+        return NULL;
+    }
+    self->busy = 1;
+    PyObject* py_msg = deviceapps_iter_next_record(self);
+    self->busy = 0;
+    return py_msg;
+}
+
+static PyObject* deviceapps_iter_close(DeviceAppsIterObject* self, PyObject* Py_UNUSED(ignored)) {
+    if (self->busy) {
+        PyErr_SetString(PyExc_ValueError, "DeviceAppsIterator already executing.");
+        return NULL;
+    }
+    deviceapps_iter_close_file(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject* deviceapps_iter_enter(DeviceAppsIterObject* self, PyObject* Py_UNUSED(ignored)) {
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject* deviceapps_iter_exit(DeviceAppsIterObject* self, PyObject* args) {
+    PyObject* result = deviceapps_iter_close(self, NULL);
+    if (result == NULL)
+        return NULL;
+    Py_DECREF(result);
+    Py_RETURN_FALSE;
+}
+
+static PyMemberDef DeviceAppsIterMembers[] = {
+    {"skipped_records", T_PYSSIZET, offsetof(DeviceAppsIterObject, recovery.records), READONLY,
+     "Malformed records skipped by recover=True so far (as their checksummed headers tell in damaged spans)"},
+    {"skipped_bytes", T_PYSSIZET, offsetof(DeviceAppsIterObject, recovery.bytes), READONLY,
+     "Bytes (of uncompressed stream) skipped by recover=True so far"},
+    {NULL}
+};
+
+static PyMethodDef DeviceAppsIterMethods[] = {
+    {"close", (PyCFunction)deviceapps_iter_close, METH_NOARGS, "Close underlying file, further iteration stops"},
+    {"__enter__", (PyCFunction)deviceapps_iter_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)deviceapps_iter_exit, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject DeviceAppsIterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "pb.DeviceAppsIterator",
+    .tp_doc = "Lazy iterator of DeviceApps dicts read from gzipped protobuf file",
+    .tp_basicsize = sizeof(DeviceAppsIterObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor)deviceapps_iter_dealloc,
+    .tp_iter = PyObject_SelfIter,
+    .tp_iternext = (iternextfunc)deviceapps_iter_next,
+    .tp_methods = DeviceAppsIterMethods,
+    .tp_members = DeviceAppsIterMembers,
+};
+
+// Start parallel reader of fname from offset (a member start) with n_threads workers.
+// Return 0 on success or -1 on error (with Python exception set).
+static int deviceapps_iter_start_reader(DeviceAppsIterObject* self, const char* fname, int n_threads, off_t offset) {
+    pbinflate_reader_t* reader = calloc(1, sizeof(pbinflate_reader_t));
+    if (!reader) {
+        PyErr_SetString(PyExc_MemoryError, "Memory error.");
+        return -1;
+    }
+    reader->fallback_offset = -1;
+    reader->file = fopen(fname, "rb");
+    if (!reader->file || fseeko(reader->file, offset, SEEK_SET)) {
+        if (reader->file)
+            fclose(reader->file);
+        free(reader);
+        PyErr_Format(PyExc_OSError, "fopen of '%s' failed.", fname);
+        return -1;
+    }
+    reader->scan_offset = offset;
+    reader->types = self->types;
+    reader->pool.arg = NULL;
+    reader->pool.worker_init = pbinflate_worker_init;
+    reader->pool.worker_free = pbinflate_worker_free;
+    reader->pool.run = pbinflate_run;
+    reader->pool.job_free = pbinflate_job_free;
+    if (pbpool_init(&reader->pool, n_threads, sizeof(pbinflate_job_t)) < 0) {
+        fclose(reader->file);
+        free(reader);
+        return -1;
+    }
+    self->reader = reader;
+    return 0;
+}
+
+// Find the last indexed block of fname (open as fd) starting not after record start.
+// Index is used only if it matches the file (totals entry gives its size, header its check).
+// Put the block first record ordinal to *record and its file offset to *zoffset, they are 0 without index.
+// Return 0 on success or -1 on memory error (with Python exception set).
+static int pbindex_find(const char* fname, int fd, size_t start, uint64_t* record, off_t* zoffset) {
+    *record = 0;
+    *zoffset = 0;
+    char* index_fname = pbindex_fname(fname);
+    if (!index_fname)
+        return -1;
+    FILE* file = fopen(index_fname, "rb");
+    free(index_fname);
+    if (!file)
+        return 0;
+    pbindex_header_t header;
+    pbindex_entry_t* entries = NULL;
+    struct stat st;
+    uint64_t check;
+    if (fread(&header, sizeof(pbindex_header_t), 1, file) == 1 && !memcmp(header.magic, PBINDEX_MAGIC, 4)
+        && header.version == PBINDEX_VERSION && header.n_entries >= 1 && header.n_entries <= SIZE_MAX / sizeof(pbindex_entry_t)
+        && (entries = malloc(header.n_entries * sizeof(pbindex_entry_t)))
+        && fread(entries, sizeof(pbindex_entry_t), header.n_entries, file) == header.n_entries
+        && !fstat(fd, &st) && entries[header.n_entries - 1].zoffset == (uint64_t)st.st_size
+        && !pbindex_file_check(fd, st.st_size, &check) && check == header.check) {
+        // binary search over block entries (the last one is totals)
+        size_t lo = 0, hi = header.n_entries - 1;
+        while (hi - lo > 1) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (entries[mid].record <= start)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        if (header.n_entries > 1 && entries[lo].record <= start) {
+            *record = entries[lo].record;
+            *zoffset = entries[lo].zoffset;
+        }
+    }
+    free(entries);
+    fclose(file);
+    return 0;
+}
+
+// Map uncompressed file fd of size bytes into memory and skip self->skip records by their headers.
+// Return 0 on success or -1 on error (with Python exception set).
+static int deviceapps_iter_map(DeviceAppsIterObject* self, int fd, size_t size) {
+    uint8_t* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    PbColumnObject* map = PyObject_New(PbColumnObject, &PbColumnType);
+    if (map == NULL) {
+        munmap(data, size);
+        return -1;
+    }
+    map->data = data;
+    map->length = size;
+    map->itemsize = 1;
+    map->format[0] = 'B';
+    map->format[1] = 0;
+    map->mapped = 1;
+    self->map = map;
+
+    size_t pos = 0;
+    Py_BEGIN_ALLOW_THREADS
+    size_t length;
+    Py_ssize_t header_size;
+    while (self->skip && (header_size = pbheader_get(data + pos, size - pos, &length)) > 0) {
+        if (size - pos - header_size < length)
+            break;  // left to parsing to report
+        if (pbtypes_has(self->types, pbheader_type(data + pos)))
+            self->skip--;
+        pos += header_size + length;
+    }
+    Py_END_ALLOW_THREADS
+    self->map_pos = pos;
+    return 0;
+}
+
+// Open reader of fname of records [start, stop): mapped if the file is not compressed, otherwise
+// sequential, or parallel one if threads > 1 for gzip. Codec is detected by magic bytes.
+// dictionary (NULL if not given) is used if frames of the file were compressed with it.
+// types (malloc'ed, NULL for DeviceApps ones) are passed to the iterator, start/stop count records of them,
+// and the block index (which counts all records) is used only without types.
+// Return new iterator or NULL on error (with Python exception set).
+static DeviceAppsIterObject* deviceapps_iter_open(const char* fname, int threads, size_t start, size_t stop, int raw,
+                                                  int recover, const Py_buffer* dictionary, pbtypes_t* types) {
+    if (threads < 1) {
+        PyErr_SetString(PyExc_ValueError, "threads must be positive.");
+        free(types);
+        return NULL;
+    }
+
+    if (access(fname, F_OK) == -1 ) {
+        PyErr_Format(PyExc_OSError, "No such file: %s", fname);
+        free(types);
+        return NULL;
+    }
+
+    DeviceAppsIterObject* py_iter = PyObject_New(DeviceAppsIterObject, &DeviceAppsIterType);
+    if (py_iter == NULL) {
+        free(types);
+        return NULL;
+    }
+    py_iter->zfile = NULL;
+    py_iter->decoder = NULL;
+    py_iter->batch = (device_apps_batch_t)DEVICE_APPS_BATCH_INIT;
+    py_iter->reader = NULL;
+    py_iter->views = NULL;
+    py_iter->view_index = 0;
+    py_iter->views_error = 0;
+    py_iter->carry = (pbscratch_t)PBSCRATCH_INIT;
+    py_iter->carry_start = py_iter->carry_size = 0;
+    py_iter->map = NULL;
+    py_iter->map_view = NULL;
+    py_iter->map_pos = 0;
+    py_iter->skip = start;
+    py_iter->remaining = stop > start ? stop - start : 0;
+    py_iter->raw = raw;
+    py_iter->types = types;
+    py_iter->discard = 0;
+    py_iter->recover = recover;
+    py_iter->recovery = (pbrecovery_t){0, 0};
+    py_iter->busy = 0;
+#ifdef PB_VALIDATE_DECODER
+    py_iter->arena = (pbarena_t)PBARENA_INIT;
+    py_iter->allocator = (ProtobufCAllocator){pbarena_alloc, pbarena_free, &py_iter->arena};
+#endif
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        PyErr_Format(PyExc_OSError, "open of '%s' failed.", fname);
+        Py_DECREF(py_iter);
+        return NULL;
+    }
+    uint8_t magic[4];
+    ssize_t magic_size = pread(fd, magic, sizeof(magic), 0);
+    const pbcodec_t* codec = pbcodec_detect(magic, magic_size > 0 ? magic_size : 0);
+    struct stat st;
+    if (!codec && !fstat(fd, &st) && st.st_size > 0) {
+        int rc = deviceapps_iter_map(py_iter, fd, st.st_size);
+        close(fd);
+        if (rc < 0) {
+            Py_DECREF(py_iter);
+            return NULL;
         }
+        return py_iter;
+    }
 
-        // optional bytes id = 1;
-        if (pbf_device_apps->device->has_id) {
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            PyObject* py_value = Py_BuildValue("s#", pbf_device_apps->device->id.data, pbf_device_apps->device->id.len);
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            if (py_value == NULL) {
-                PyErr_SetFromErrno(PyExc_RuntimeError);   
-                Py_DECREF(py_device);
-                goto error;
-            }
-            PyDict_SetItemString(py_device, "id", py_value);
-            Py_DECREF(py_value);
-            if (PyErr_Occurred()) {            
-                PyErr_SetFromErrno(PyExc_RuntimeError);   
-                Py_DECREF(py_device);
-                goto error;
-            }
+    uint64_t record = 0;
+    off_t zoffset = 0;
+    if (start && !types && pbindex_find(fname, fd, start, &record, &zoffset) < 0) {
+        close(fd);
+        Py_DECREF(py_iter);
+        return NULL;
+    }
+    py_iter->skip -= record;
+    if (codec && codec->decompress) {
+        void* ddict;
+        if (pbdecoder_load_dictionary(codec, fd, zoffset, dictionary, &ddict) < 0) {
+            close(fd);
+            Py_DECREF(py_iter);
+            return NULL;
+        }
+        if (lseek(fd, zoffset, SEEK_SET) != zoffset) {
+            close(fd);
+            if (ddict)
+                codec->ddict_free(ddict);
+            PyErr_Format(PyExc_OSError, "lseek of '%s' failed.", fname);
+            Py_DECREF(py_iter);
+            return NULL;
+        }
+        py_iter->decoder = pbdecoder_new(codec, fd, ddict);
+        if (!py_iter->decoder) {
+            Py_DECREF(py_iter);
+            return NULL;
         }
+        return py_iter;
+    }
+    if (threads > 1) {
+        close(fd);
+        if (deviceapps_iter_start_reader(py_iter, fname, threads, zoffset) < 0) {
+            Py_DECREF(py_iter);
+            return NULL;
+        }
+        return py_iter;
+    }
+    if (lseek(fd, zoffset, SEEK_SET) == zoffset)
+        py_iter->zfile = gzdopen(fd, "rb");
+    if (py_iter->zfile == NULL) {
+        close(fd);
+        PyErr_Format(PyExc_OSError, "gzopen of '%s' failed.", fname);
+        Py_DECREF(py_iter);
+        return NULL;
+    }
+    return py_iter;
+}
 
-        // optional bytes type = 2;
-        if (pbf_device_apps->device->has_type) {
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            PyObject* py_value = Py_BuildValue("s#", pbf_device_apps->device->type.data, pbf_device_apps->device->type.len);
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            if (py_value == NULL) {
-                PyErr_SetFromErrno(PyExc_RuntimeError);   
-                Py_DECREF(py_device);
-                goto error;
-            }
-            PyDict_SetItemString(py_device, "type", py_value);
-            Py_DECREF(py_value);
-            if (PyErr_Occurred()) {            
-                PyErr_SetFromErrno(PyExc_RuntimeError);   
-                Py_DECREF(py_device);
-                goto error;
-            }
+// Parse start=/stop= arguments (stop=None reads to the end) into *start and *stop (SIZE_MAX for the end).
+// Return 0 on success or -1 on error (with Python exception set).
+static int parse_record_range(Py_ssize_t py_start, PyObject* py_stop, size_t* start, size_t* stop) {
+    if (py_start < 0) {
+        PyErr_SetString(PyExc_ValueError, "start must not be negative.");
+        return -1;
+    }
+    *start = py_start;
+    *stop = SIZE_MAX;
+    if (py_stop != Py_None) {
+        Py_ssize_t value = PyLong_AsSsize_t(py_stop);
+        if (value < 0) {
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_ValueError, "stop must not be negative.");
+            return -1;
         }
-        PyDict_SetItemString(py_device_apps, "device", py_device);
-        Py_DECREF(py_device);
-        if (PyErr_Occurred()) {            
-            PyErr_SetFromErrno(PyExc_RuntimeError);   
-            goto error;
+        *stop = value;
+    }
+    return 0;
+}
+
+// Parse types= argument of readers (None for DeviceApps types) into *types (malloc'ed, NULL for None).
+// Types other than DeviceApps ones can be read raw only.
+// Return 0 on success or -1 on error (with Python exception set).
+static int parse_types(PyObject* py_types, int raw, pbtypes_t** types) {
+    *types = NULL;
+    if (py_types == Py_None)
+        return 0;
+    PyObject* py_iter = PyObject_GetIter(py_types);
+    if (py_iter == NULL)
+        return -1;
+    *types = calloc(1, sizeof(pbtypes_t));
+    if (!*types) {
+        Py_DECREF(py_iter);
+        PyErr_SetString(PyExc_MemoryError, "Memory error.");
+        return -1;
+    }
+    PyObject* py_item;
+    while ((py_item = PyIter_Next(py_iter))) {
+        long type = PyLong_AsLong(py_item);
+        Py_DECREF(py_item);
+        if (type == -1 && PyErr_Occurred())
+            break;
+        if (type < 0 || type > PBTYPE_MAX) {
+            PyErr_Format(PyExc_ValueError, "Record type must be from 0 to %d.", PBTYPE_MAX);
+            break;
+        }
+        if (!raw && !is_device_apps_type(type)) {
+            PyErr_Format(PyExc_ValueError, "Records of type %ld can be read with raw=True only.", type);
+            break;
         }
+        (*types)->bits[type / 8] |= 1 << (type % 8);
+    }
+    Py_DECREF(py_iter);
+    if (PyErr_Occurred()) {
+        free(*types);
+        *types = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Unpack only messages of DeviceApps types (DEVICE_APPS_TYPE, DEVICE_APPS_PACKED_TYPE), records of other types
+// are skipped by their headers
+// types=set of wanted record types (DeviceApps ones by default) reads only these, any types with raw=True,
+// start/stop count records of them then
+// threads > 1 inflates and parses gzip members on that many threads (see pbinflate_reader_t)
+// start/stop read records [start, stop) only, seeking with the block index if the file has one
+// Uncompressed files (codec="none") are mapped into memory and decoded in place
+// raw=True yields framed records (memoryview slices of mapped file, or bytes) instead of dicts
+// dictionary=bytes the file was written with (deviceapps_xwrite_pb(dictionary=)), ValueError if it is needed
+// recover=True skips malformed records instead of raising ValueError (see pbrecovery_t), a broken compressed
+// stream ends reading as truncated one; iterator's skipped_records and skipped_bytes tell the loss
+// Return iterator of Python dicts
+static PyObject* py_deviceapps_xread_pb(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"", "threads", "start", "stop", "raw", "recover", "dictionary", "types", NULL};
+    const char* fname;
+    int threads = 1;
+    Py_ssize_t py_start = 0;
+    PyObject* py_stop = Py_None;
+    int raw = 0;
+    int recover = 0;
+    Py_buffer dictionary = {NULL};
+    PyObject* py_types = Py_None;
+    size_t start, stop;
+    pbtypes_t* types;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|$inOppy*O", kwlist, &fname, &threads, &py_start, &py_stop, &raw,
+                                     &recover, &dictionary, &py_types))
+        return NULL;
+    DeviceAppsIterObject* py_iter = NULL;
+    if (parse_record_range(py_start, py_stop, &start, &stop) == 0 && parse_types(py_types, raw, &types) == 0)
+        py_iter = deviceapps_iter_open(fname, threads, start, stop, raw, recover, dictionary.buf ? &dictionary : NULL,
+                                       types);
+    PyBuffer_Release(&dictionary);
+    return (PyObject*)py_iter;
+}
+
+// Column being built: items of itemsize bytes (bits for bitmaps)
+typedef struct pbcolumn_builder_s {
+    pbscratch_t data;
+    size_t length;
+} pbcolumn_builder_t;
+
+// Reserve room for n more items of itemsize bytes, return pointer to it or NULL on memory error.
+// The column is allocated even for n == 0, so NULL always means an error.
+static inline void* pbcolumn_builder_extend(pbcolumn_builder_t* column, size_t n, size_t itemsize) {
+    uint8_t* data = pbscratch_reserve(&column->data, (column->length + n) * itemsize + 1);
+    if (!data)
+        return NULL;
+    data += column->length * itemsize;
+    column->length += n;
+    return data;
+}
 
+// Turn builder into Column of length items (ownership of data is passed).
+static PyObject* pbcolumn_builder_finish(pbcolumn_builder_t* column, Py_ssize_t length, Py_ssize_t itemsize, char format) {
+    // empty column still gets valid (non NULL) buffer
+    if (!column->data.data && !pbscratch_reserve(&column->data, 1)) {
+        PyErr_SetString(PyExc_MemoryError, "Memory error.");
+        return NULL;
     }
+    PbColumnObject* py_column = PyObject_New(PbColumnObject, &PbColumnType);
+    if (py_column == NULL)
+        return NULL;
+    py_column->data = column->data.data;
+    py_column->length = length;
+    py_column->itemsize = itemsize;
+    py_column->format[0] = format;
+    py_column->format[1] = 0;
+    py_column->mapped = 0;
+    column->data = (pbscratch_t)PBSCRATCH_INIT;
+    column->length = 0;
+    return (PyObject*)py_column;
+}
 
-    // repeated uint32 apps = 2;
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    PyObject* py_apps = PyList_New(0);
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    if (py_apps == NULL) {            
-        PyErr_SetFromErrno(PyExc_RuntimeError);        
-        goto error;
-    }    
-    if (pbf_device_apps->n_apps) {
-        for (size_t i = 0; i < pbf_device_apps->n_apps; i++) {
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            PyObject* py_value = PyLong_FromLong(pbf_device_apps->apps[i]);
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            if (py_value == NULL) {            
-                PyErr_SetFromErrno(PyExc_RuntimeError);        
-                Py_DECREF(py_apps);
-                goto error;
-            }
-            PyList_Append(py_apps, py_value);
-            Py_DECREF(py_value);
-            if (PyErr_Occurred()) {            
-                PyErr_SetFromErrno(PyExc_RuntimeError);        
-                Py_DECREF(py_apps);
-                goto error;
-            }
+// Columns of DeviceApps file. Absent values are zero (empty), presence bitmaps are bit-packed
+// least significant bit first (as Arrow validity bitmaps), variable length values are stored
+// back to back with n + 1 offsets (value i is [offsets[i], offsets[i + 1])).
+enum {
+    COLUMN_LAT, COLUMN_LON, COLUMN_APPS, COLUMN_APPS_OFFSETS,
+    COLUMN_DEVICE_ID, COLUMN_DEVICE_ID_OFFSETS, COLUMN_DEVICE_TYPE, COLUMN_DEVICE_TYPE_OFFSETS,
+    COLUMN_HAS_LAT, COLUMN_HAS_LON, COLUMN_HAS_DEVICE, COLUMN_HAS_DEVICE_ID, COLUMN_HAS_DEVICE_TYPE,
+    COLUMNS_COUNT
+};
+#define COLUMN_BITMAPS COLUMN_HAS_LAT
+
+static const struct {
+    const char* name;
+    char format;
+    size_t itemsize;
+} pbcolumns_spec[COLUMNS_COUNT] = {
+    {"lat", 'd', sizeof(double)},
+    {"lon", 'd', sizeof(double)},
+    {"apps", 'I', sizeof(uint32_t)},
+    {"apps_offsets", 'q', sizeof(int64_t)},
+    {"device_id", 'B', 1},
+    {"device_id_offsets", 'q', sizeof(int64_t)},
+    {"device_type", 'B', 1},
+    {"device_type_offsets", 'q', sizeof(int64_t)},
+    {"has_lat", 'B', 1},
+    {"has_lon", 'B', 1},
+    {"has_device", 'B', 1},
+    {"has_device_id", 'B', 1},
+    {"has_device_type", 'B', 1},
+};
+
+typedef struct pbcolumns_s {
+    pbcolumn_builder_t columns[COLUMNS_COUNT];
+    size_t n;  // records
+} pbcolumns_t;
+
+static void pbcolumns_free(pbcolumns_t* columns) {
+    for (int i = 0; i < COLUMNS_COUNT; i++)
+        pbscratch_free(&columns->columns[i].data);
+}
+
+static inline int pbcolumns_append_bytes(pbcolumns_t* columns, int column, const uint8_t* data, size_t len) {
+    uint8_t* out = pbcolumn_builder_extend(&columns->columns[column], len, 1);
+    int64_t* offset = pbcolumn_builder_extend(&columns->columns[column + 1], 1, sizeof(int64_t));
+    if (!out || !offset)
+        return -1;
+    memcpy(out, data, len);
+    *offset = columns->columns[column].length;
+    return 0;
+}
+
+// Append parsed records to columns, runs without the GIL. Return 0 on success or -1 on memory error.
+static int pbcolumns_append(pbcolumns_t* columns, const device_apps_view_t* views, size_t n_views, const uint32_t* apps) {
+    size_t n = columns->n + n_views;
+    for (int i = COLUMN_BITMAPS; i < COLUMNS_COUNT; i++) {
+        pbcolumn_builder_t* bitmap = &columns->columns[i];
+        size_t bytes = (n + 7) / 8;
+        size_t extra = bytes - bitmap->length;
+        if (extra) {
+            uint8_t* out = pbcolumn_builder_extend(bitmap, extra, 1);
+            if (!out)
+                return -1;
+            memset(out, 0, extra);
         }
     }
-    PyDict_SetItemString(py_device_apps, "apps", py_apps);
-    Py_DECREF(py_apps);
+    double* lat = pbcolumn_builder_extend(&columns->columns[COLUMN_LAT], n_views, sizeof(double));
+    double* lon = pbcolumn_builder_extend(&columns->columns[COLUMN_LON], n_views, sizeof(double));
+    if (!lat || !lon)
+        return -1;
+    for (size_t i = 0; i < n_views; i++) {
+        const device_apps_view_t* view = &views[i];
+        size_t record = columns->n + i;
+        uint8_t bit = 1 << (record % 8);
+        lat[i] = view->has_lat ? view->lat : 0;
+        lon[i] = view->has_lon ? view->lon : 0;
+        if (view->has_lat)
+            ((uint8_t*)columns->columns[COLUMN_HAS_LAT].data.data)[record / 8] |= bit;
+        if (view->has_lon)
+            ((uint8_t*)columns->columns[COLUMN_HAS_LON].data.data)[record / 8] |= bit;
+        if (view->has_device)
+            ((uint8_t*)columns->columns[COLUMN_HAS_DEVICE].data.data)[record / 8] |= bit;
+        if (view->has_device_id)
+            ((uint8_t*)columns->columns[COLUMN_HAS_DEVICE_ID].data.data)[record / 8] |= bit;
+        if (view->has_device_type)
+            ((uint8_t*)columns->columns[COLUMN_HAS_DEVICE_TYPE].data.data)[record / 8] |= bit;
 
-    // optional double lat = 3;
-    if (pbf_device_apps->has_lat) {
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-        PyObject* py_value = PyFloat_FromDouble(pbf_device_apps->lat);
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-        if (py_value == NULL) {            
-            PyErr_SetFromErrno(PyExc_RuntimeError);      
-            goto error;
+        uint32_t* out = pbcolumn_builder_extend(&columns->columns[COLUMN_APPS], view->n_apps, sizeof(uint32_t));
+        int64_t* offset = pbcolumn_builder_extend(&columns->columns[COLUMN_APPS_OFFSETS], 1, sizeof(int64_t));
+        if (!out || !offset)
+            return -1;
+        memcpy(out, apps + view->apps_offset, view->n_apps * sizeof(uint32_t));
+        *offset = columns->columns[COLUMN_APPS].length;
+        if (pbcolumns_append_bytes(columns, COLUMN_DEVICE_ID, view->device_id, view->device_id_len) < 0
+            || pbcolumns_append_bytes(columns, COLUMN_DEVICE_TYPE, view->device_type, view->device_type_len) < 0)
+            return -1;
+    }
+    columns->n = n;
+    return 0;
+}
+
+// Read the whole file (or records [start, stop)) into columns (see pbcolumns_t),
+// records are never turned into Python objects.
+// threads > 1 inflates and parses gzip members on that many threads (see pbinflate_reader_t)
+// Return dict of pb.Column by column name, plus "count" of records
+static PyObject* py_deviceapps_xread_columns(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"", "threads", "start", "stop", "dictionary", NULL};
+    const char* fname;
+    int threads = 1;
+    Py_ssize_t py_start = 0;
+    PyObject* py_stop = Py_None;
+    Py_buffer dictionary = {NULL};
+    size_t start, stop;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|$inOy*", kwlist, &fname, &threads, &py_start, &py_stop,
+                                     &dictionary))
+        return NULL;
+    DeviceAppsIterObject* py_iter = NULL;
+    if (parse_record_range(py_start, py_stop, &start, &stop) == 0)
+        py_iter = deviceapps_iter_open(fname, threads, start, stop, 0, 0, dictionary.buf ? &dictionary : NULL, NULL);
+    PyBuffer_Release(&dictionary);
+    if (py_iter == NULL)
+        return NULL;
+
+    pbcolumns_t columns;
+    memset(&columns, 0, sizeof(pbcolumns_t));
+    PyObject* py_columns = NULL;
+    // offsets start with 0
+    for (int i = COLUMN_APPS_OFFSETS; i <= COLUMN_DEVICE_TYPE_OFFSETS; i += 2) {
+        int64_t* offset = pbcolumn_builder_extend(&columns.columns[i], 1, sizeof(int64_t));
+        if (!offset) {
+            PyErr_SetString(PyExc_MemoryError, "Memory error.");
+            goto done;
         }
-        PyDict_SetItemString(py_device_apps, "lat", py_value);
-        Py_DECREF(py_value);
-        if (PyErr_Occurred()) {            
-            PyErr_SetFromErrno(PyExc_RuntimeError);        
-            goto error;
+        *offset = 0;
+    }
+    int rc;
+    while ((rc = deviceapps_iter_advance(py_iter)) > 0) {
+        const device_apps_batch_t* views = py_iter->views;
+        size_t n = views->n_views - py_iter->view_index;
+        n = n < py_iter->remaining ? n : py_iter->remaining;
+        Py_BEGIN_ALLOW_THREADS
+        PBSTATS_START(started);
+        rc = pbcolumns_append(&columns, (const device_apps_view_t*)views->views.data + py_iter->view_index,
+                              n, views->apps.data);
+        PBSTATS_STOP(PBSTAGE_BUILD, started);
+        PBSTATS_ADD(built, n);
+        Py_END_ALLOW_THREADS
+        py_iter->view_index += n;
+        py_iter->remaining -= n;
+        if (rc < 0) {
+            PyErr_SetString(PyExc_MemoryError, "Memory error.");
+            goto done;
         }
     }
+    if (rc < 0)
+        goto done;
 
-    // optional double lon = 4;
-    if (pbf_device_apps->has_lon) {
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-        PyObject* py_value = PyFloat_FromDouble(pbf_device_apps->lon);
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-        if (py_value == NULL) {            
-            PyErr_SetFromErrno(PyExc_RuntimeError);      
-            goto error;
-        }
-        PyDict_SetItemString(py_device_apps, "lon", py_value);
-        Py_DECREF(py_value);
-        if (PyErr_Occurred()) {
-            PyErr_SetFromErrno(PyExc_RuntimeError);        
-            goto error;
+    py_columns = PyDict_New();
+    if (py_columns == NULL)
+        goto done;
+    PyObject* py_count = PyLong_FromSize_t(columns.n);
+    if (py_count == NULL || PyDict_SetItemString(py_columns, "count", py_count) < 0) {
+        Py_XDECREF(py_count);
+        Py_CLEAR(py_columns);
+        goto done;
+    }
+    Py_DECREF(py_count);
+    for (int i = 0; i < COLUMNS_COUNT; i++) {
+        pbcolumn_builder_t* column = &columns.columns[i];
+        PyObject* py_column = pbcolumn_builder_finish(column, column->length, pbcolumns_spec[i].itemsize, pbcolumns_spec[i].format);
+        if (py_column == NULL || PyDict_SetItemString(py_columns, pbcolumns_spec[i].name, py_column) < 0) {
+            Py_XDECREF(py_column);
+            Py_CLEAR(py_columns);
+            goto done;
         }
+        Py_DECREF(py_column);
     }
 
-    return py_device_apps;
+done:
+    pbcolumns_free(&columns);
+    Py_DECREF(py_iter);
+    return py_columns;
+}
 
-error:
-    Py_XDECREF(py_device_apps);
-    return NULL;
+// Columns given to deviceapps_xwrite_columns as buffers, laid out as deviceapps_xread_columns returns them.
+// A value is present if its bitmap bit is set or, without bitmap, if its column is given at all;
+// device is present if its bitmap bit is set or, without bitmap, if device id or type is present.
+static inline int pbcolumns_present(const Py_buffer* columns, int bitmap, int column, size_t i) {
+    if (columns[bitmap].buf)
+        return (((const uint8_t*)columns[bitmap].buf)[i / 8] >> (i % 8)) & 1;
+    return columns[column].buf != NULL;
+}
+
+// Point view at [offsets[i], offsets[i + 1]) of column, return 0 if offsets are out of range.
+static inline int pbcolumns_slice(const Py_buffer* columns, int column, size_t i, size_t* start, size_t* len) {
+    const int64_t* offsets = columns[column + 1].buf;
+    int64_t size = columns[column].len / columns[column].itemsize;
+    if (offsets[i] < 0 || offsets[i] > offsets[i + 1] || offsets[i + 1] > size)
+        return 0;
+    *start = offsets[i];
+    *len = offsets[i + 1] - offsets[i];
+    return 1;
 }
 
+// Encode records from *next on into batch until it reaches block_size bytes or records end.
+// Touches no Python objects, so runs without the GIL.
+// Return 0 on success, 1 on invalid offsets, 2 on too long record and -1 on memory error.
+static int pbcolumns_encode(const Py_buffer* columns, size_t count, int packed, uint16_t header_flags, size_t block_size,
+                            size_t* next, pbscratch_t* batch, size_t* batch_size) {
+    size_t size = 0;
+    const double* lat = columns[COLUMN_LAT].buf;
+    const double* lon = columns[COLUMN_LON].buf;
+    const uint32_t* apps = columns[COLUMN_APPS].buf;
+    PBSTATS_RECORDS(packed_records);
+    for (size_t i = *next; i < count && size < block_size; i++) {
+        device_apps_view_t view;
+        memset(&view, 0, sizeof(device_apps_view_t));
+        size_t start, len;
+        if (apps && !pbcolumns_slice(columns, COLUMN_APPS, i, &view.apps_offset, &view.n_apps))
+            return 1;
+        if ((view.has_device_id = pbcolumns_present(columns, COLUMN_HAS_DEVICE_ID, COLUMN_DEVICE_ID, i))
+            && columns[COLUMN_DEVICE_ID].buf) {
+            if (!pbcolumns_slice(columns, COLUMN_DEVICE_ID, i, &start, &len))
+                return 1;
+            view.device_id = (const uint8_t*)columns[COLUMN_DEVICE_ID].buf + start;
+            view.device_id_len = len;
+        }
+        if ((view.has_device_type = pbcolumns_present(columns, COLUMN_HAS_DEVICE_TYPE, COLUMN_DEVICE_TYPE, i))
+            && columns[COLUMN_DEVICE_TYPE].buf) {
+            if (!pbcolumns_slice(columns, COLUMN_DEVICE_TYPE, i, &start, &len))
+                return 1;
+            view.device_type = (const uint8_t*)columns[COLUMN_DEVICE_TYPE].buf + start;
+            view.device_type_len = len;
+        }
+        view.has_device = columns[COLUMN_HAS_DEVICE].buf
+            ? pbcolumns_present(columns, COLUMN_HAS_DEVICE, COLUMN_HAS_DEVICE, i)
+            : view.has_device_id || view.has_device_type;
+        if ((view.has_lat = pbcolumns_present(columns, COLUMN_HAS_LAT, COLUMN_LAT, i)) && lat)
+            view.lat = lat[i];
+        if ((view.has_lon = pbcolumns_present(columns, COLUMN_HAS_LON, COLUMN_LON, i)) && lon)
+            view.lon = lon[i];
 
-// Unpack only messages with type == DEVICE_APPS_TYPE
-// Return iterator of Python dicts
-static PyObject* py_deviceapps_xread_pb(PyObject* self, PyObject* args) {
+        uint8_t* out = pbscratch_reserve(batch, size + device_apps_max_size(&view, packed));
+        if (!out)
+            return -1;
+        Py_ssize_t record_size = device_apps_put(out + size, &view, apps, packed, header_flags);
+        if (record_size < 0)
+            return 2;
+        PBSTATS_RECORD(packed_records, record_size);
+        size += record_size;
+        *next = i + 1;
+    }
+    PBSTATS_MERGE(packed, packed_records);
+    *batch_size = size;
+    return 0;
+}
+
+// Get buffer of column argument and check its item type against pbcolumns_spec.
+// Return 0 on success or -1 on error (with Python exception set).
+static int pbcolumns_get_buffer(PyObject* obj, int column, Py_buffer* buffer) {
+    if (PyObject_GetBuffer(obj, buffer, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0)
+        return -1;
+    const char* format = buffer->format ? buffer->format : "B";
+    if (format[0] == '@' || format[0] == '=' || format[0] == (PY_LITTLE_ENDIAN ? '<' : '>'))  // native byte order
+        format++;
+    const char* accepted;
+    switch (pbcolumns_spec[column].format) {
+        case 'd': accepted = "d"; break;
+        case 'I': accepted = "IL"; break;  // unsigned as get_apps takes, 'L' of 4 bytes by itemsize
+        case 'q': accepted = "qQlLnN"; break;
+        default: accepted = "bBc?"; break;
+    }
+    if ((size_t)buffer->itemsize != pbcolumns_spec[column].itemsize || !format[0] || format[1] || !strchr(accepted, format[0])) {
+        PyErr_Format(PyExc_TypeError, "[%s] must be a buffer of '%c' items not '%s'",
+                     pbcolumns_spec[column].name, pbcolumns_spec[column].format, buffer->format ? buffer->format : "B");
+        PyBuffer_Release(buffer);
+        return -1;
+    }
+    return 0;
+}
+
+// Write columns (in layout of deviceapps_xread_columns result, all optional)
+// as DeviceApps records, the same as deviceapps_xwrite_pb writes for equivalent dicts.
+// Encoding and compression run without the GIL.
+// count of records is taken from lat, lon or offsets if not given
+// Return number of written (uncompressed) bytes as Python integer
+static PyObject* py_deviceapps_xwrite_columns(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"", "count",
+        "lat", "lon", "apps", "apps_offsets",
+        "device_id", "device_id_offsets", "device_type", "device_type_offsets",
+        "has_lat", "has_lon", "has_device", "has_device_id", "has_device_type",
+        "packed", "wide", "checksum", "threads", "index", "codec", "block_size", "dictionary", NULL};
     const char* fname;
-    if (!PyArg_ParseTuple(args, "s", &fname))
+    PyObject* py_count = Py_None;
+    PyObject* objs[COLUMNS_COUNT] = {NULL};
+    int packed = 0;
+    int wide = 0;
+    int checksum = 0;
+    int threads = 1;
+    int index = 0;
+    const char* codec_name = "gzip";
+    const pbcodec_t* codec;
+    Py_ssize_t block_size = PBWRITE_BATCH;
+    Py_buffer dictionary = {NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|$OOOOOOOOOOOOOOpppipsny*", kwlist, &fname, &py_count,
+                                     &objs[COLUMN_LAT], &objs[COLUMN_LON], &objs[COLUMN_APPS], &objs[COLUMN_APPS_OFFSETS],
+                                     &objs[COLUMN_DEVICE_ID], &objs[COLUMN_DEVICE_ID_OFFSETS],
+                                     &objs[COLUMN_DEVICE_TYPE], &objs[COLUMN_DEVICE_TYPE_OFFSETS],
+                                     &objs[COLUMN_HAS_LAT], &objs[COLUMN_HAS_LON], &objs[COLUMN_HAS_DEVICE],
+                                     &objs[COLUMN_HAS_DEVICE_ID], &objs[COLUMN_HAS_DEVICE_TYPE], &packed, &wide, &checksum,
+                                     &threads, &index, &codec_name, &block_size, &dictionary))
         return NULL;
 
-    if (access(fname, F_OK) == -1 ) {
-        PyErr_Format(PyExc_OSError, "No such file: %s", fname);
-        return NULL;
+    Py_buffer columns[COLUMNS_COUNT];
+    memset(columns, 0, sizeof(columns));
+    PyObject* result = NULL;
+    int i;
+    if (parse_codec(codec_name, &codec) < 0)
+        goto done;
+    for (i = 0; i < COLUMNS_COUNT; i++)
+        if (objs[i] && objs[i] != Py_None && pbcolumns_get_buffer(objs[i], i, &columns[i]) < 0)
+            goto done;
+
+    // count of records and lengths of columns must agree
+    Py_ssize_t count = -1;
+    if (py_count != Py_None && (count = PyLong_AsSsize_t(py_count)) < 0) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_ValueError, "count must not be negative.");
+        goto done;
+    }
+    for (i = 0; i < COLUMN_BITMAPS; i++) {
+        if (!columns[i].buf || i == COLUMN_APPS || i == COLUMN_DEVICE_ID || i == COLUMN_DEVICE_TYPE)
+            continue;
+        Py_ssize_t n = columns[i].len / columns[i].itemsize - (pbcolumns_spec[i].format == 'q');
+        if (count < 0)
+            count = n;
+        if (n != count) {
+            PyErr_Format(PyExc_ValueError, "[%s] does not match count of records.", pbcolumns_spec[i].name);
+            goto done;
+        }
+    }
+    if (count < 0) {
+        PyErr_SetString(PyExc_ValueError, "count of records is unknown.");
+        goto done;
+    }
+    for (i = COLUMN_APPS; i <= COLUMN_DEVICE_TYPE; i += 2) {
+        if (!columns[i].buf != !columns[i + 1].buf) {
+            PyErr_Format(PyExc_ValueError, "[%s] and [%s] go together.", pbcolumns_spec[i].name, pbcolumns_spec[i + 1].name);
+            goto done;
+        }
+    }
+    for (i = COLUMN_BITMAPS; i < COLUMNS_COUNT; i++) {
+        if (columns[i].buf && columns[i].len < (count + 7) / 8) {
+            PyErr_Format(PyExc_ValueError, "[%s] does not match count of records.", pbcolumns_spec[i].name);
+            goto done;
+        }
     }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    PyObject* py_list = PyList_New(0);
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    if (py_list == NULL) {
-        PyErr_SetFromErrno(PyExc_RuntimeError);
-        return NULL;
+    pbwriter_t writer;
+    if (pbwriter_open(&writer, fname, threads, index, codec, block_size, dictionary.buf ? &dictionary : NULL, -1, 0, 0) < 0)
+        goto done;
+    pbscratch_t batch = PBSCRATCH_INIT;
+    size_t batch_size = 0;
+    size_t total_bytes = 0;
+    size_t next = 0;
+    int rc = 0;
+    while (!rc && next < (size_t)count) {
+        if (batch_size && writer.sink(writer.sink_data, &batch, batch_size) < 0) {
+            rc = -2;
+            break;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        PBSTATS_START(started);
+        rc = pbcolumns_encode(columns, count, packed, pbheader_flags(wide, checksum), writer.block_size, &next, &batch,
+                              &batch_size);
+        PBSTATS_STOP(PBSTAGE_PACK, started);
+        Py_END_ALLOW_THREADS
+        total_bytes += batch_size;
     }
+    if (rc == -1)
+        PyErr_SetString(PyExc_MemoryError, "Memory error.");
+    else if (rc == 1)
+        PyErr_Format(PyExc_ValueError, "Offsets of record %zu are out of range.", next);
+    else if (rc == 2)
+        PyErr_Format(PyExc_ValueError, "Record %zu is too long.", next);
+    if (pbwriter_close(&writer, &batch, batch_size, rc != 0) == 0)
+        result = PyLong_FromSize_t(total_bytes);
+    pbscratch_free(&batch);
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    gzFile zfile = gzopen(fname, "rb");
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    if (zfile == NULL) {
-        PyErr_Format(PyExc_OSError, "gzopen of '%s' failed.", fname);
-        Py_DECREF(py_list);        
+done:
+    for (i = 0; i < COLUMNS_COUNT; i++)
+        if (columns[i].obj)
+            PyBuffer_Release(&columns[i]);
+    PyBuffer_Release(&dictionary);
+    return result;
+}
+
+// CRC32C of bytes-like object, as in records of writers with checksum=True, continuing crc
+// Return int
+static PyObject* py_crc32c(PyObject* self, PyObject* args) {
+    Py_buffer buffer;
+    unsigned int crc = 0;
+    if (!PyArg_ParseTuple(args, "y*|I", &buffer, &crc))
         return NULL;
-    }
+    Py_BEGIN_ALLOW_THREADS
+    crc = pbcrc32c(crc, buffer.buf, buffer.len);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&buffer);
+    return PyLong_FromUnsignedLong(crc);
+}
 
-    while (!gzeof(zfile)) {
-        pbheader_t pbheader;
-        size_t bytes_read = gzread(zfile, &pbheader, sizeof(pbheader_t));
-        if (bytes_read) {
-            if ((bytes_read != sizeof(pbheader_t)) || (pbheader.magic != MAGIC)) {
-                PyErr_SetString(PyExc_ValueError, "Wrong file format.");
-                goto free_res; 
-            }
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            void* device_apps_buffer = malloc(pbheader.length);
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            if (!device_apps_buffer) {
-                PyErr_SetString(PyExc_MemoryError, "Memory error.");
-                goto free_res;
-            }
-            bytes_read = gzread(zfile, device_apps_buffer, pbheader.length);
-            if (bytes_read != pbheader.length){
-                PyErr_SetString(PyExc_ValueError, "Wrong file format.");
-                free(device_apps_buffer);
-                goto free_res;             
-            }
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            DeviceApps* msg = device_apps__unpack(NULL, pbheader.length, device_apps_buffer);
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            if (!msg){
-                PyErr_SetFromErrno(PyExc_RuntimeError);        
-                free(device_apps_buffer);
-                goto free_res;             
-            }
-            PyObject* py_msg = deserialize(msg);
+// Deserialize framed stream (pbheader_t + DeviceApps per record, as deviceapps_encode returns)
+// from any bytes-like object, without copying it. Records are parsed with the GIL released.
+// Records of other types than DeviceApps ones are skipped.
+// Return list of Python dicts
+static PyObject* py_deviceapps_decode(PyObject* self, PyObject* args) {
+    Py_buffer buffer;
+    if (!PyArg_ParseTuple(args, "y*", &buffer))
+        return NULL;
+
+    device_apps_batch_t batch = DEVICE_APPS_BATCH_INIT;
+    size_t consumed;
+    int rc;
+    Py_BEGIN_ALLOW_THREADS
+    rc = device_apps_parse_records(buffer.buf, buffer.len, &batch, &consumed, NULL, NULL);
+    Py_END_ALLOW_THREADS
+    PyObject* py_list = NULL;
+    if (rc < 0)
+        PyErr_SetString(PyExc_MemoryError, "Memory error.");
+    else if (rc || consumed != (size_t)buffer.len)
+        PyErr_SetString(PyExc_ValueError, "Wrong format.");
+    else if ((py_list = PyList_New(batch.n_views))) {
+        PBSTATS_START(started);
+        const device_apps_view_t* views = batch.views.data;
+        for (size_t i = 0; i < batch.n_views; i++) {
+            PyObject* py_msg = device_apps_build(&views[i], batch.apps.data);
             if (py_msg == NULL) {
-                free(device_apps_buffer);
-                device_apps__free_unpacked(msg, NULL);
-                goto free_res;             
+                Py_CLEAR(py_list);
+                break;
             }
-            PyList_Append(py_list, py_msg);
-            Py_DECREF(py_msg);
-            free(device_apps_buffer);
-            device_apps__free_unpacked(msg, NULL);
-        } else
-            break;
+            PyList_SET_ITEM(py_list, i, py_msg);
+        }
+        PBSTATS_STOP(PBSTAGE_BUILD, started);
+        PBSTATS_ADD(built, batch.n_views);
     }
+    device_apps_batch_free(&batch);
+    PyBuffer_Release(&buffer);
+    return py_list;
+}
 
-free_res:
-    gzclose(zfile);
-    if (PyErr_Occurred()) {
-        Py_DECREF(py_list);
+#ifdef PB_STATS
+static inline unsigned long long pbstats_get(const uint64_t* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// Return dict of counters of packed or parsed records or NULL on error (with Python exception set).
+static PyObject* pbstats_records_dict(const pbstats_records_t* records) {
+    PyObject* py_sizes = PyList_New(PBSTATS_SIZE_BITS);
+    if (py_sizes == NULL)
         return NULL;
+    for (int i = 0; i < PBSTATS_SIZE_BITS; i++) {
+        PyObject* py_count = PyLong_FromUnsignedLongLong(pbstats_get(&records->sizes[i]));
+        if (py_count == NULL) {
+            Py_DECREF(py_sizes);
+            return NULL;
+        }
+        PyList_SET_ITEM(py_sizes, i, py_count);
     }
-    PyObject* py_iter = PySeqIter_New(py_list);
-    Py_DECREF(py_list);
-    return py_iter;
+    return Py_BuildValue("{s:K,s:K,s:K,s:N}", "records", pbstats_get(&records->records),
+                         "bytes", pbstats_get(&records->bytes), "max_size", pbstats_get(&records->max_size),
+                         "sizes", py_sizes);
+}
+
+// Counters of instrumentation (see pbstats_t) since import or pb.reset_stats():
+// {"stages": {"pack": {"calls": n, "ns": n}, ...}, "packed": {"records": n, "bytes": n, "max_size": n, "sizes": [...]},
+//  "parsed": {...}, "built": n, "bytes_written": n, "bytes_read": n}
+// sizes[i] is number of records of i bits of size (from 2 ** (i - 1) to 2 ** i - 1 bytes).
+static PyObject* py_stats(PyObject* self, PyObject* Py_UNUSED(ignored)) {
+    PyObject* py_stages = PyDict_New();
+    if (py_stages == NULL)
+        return NULL;
+    for (int i = 0; i < PBSTAGE_COUNT; i++) {
+        PyObject* py_stage = Py_BuildValue("{s:K,s:K}", "calls", pbstats_get(&pbstats.calls[i]),
+                                           "ns", pbstats_get(&pbstats.ns[i]));
+        if (py_stage == NULL || PyDict_SetItemString(py_stages, pbstage_names[i], py_stage) < 0) {
+            Py_XDECREF(py_stage);
+            Py_DECREF(py_stages);
+            return NULL;
+        }
+        Py_DECREF(py_stage);
+    }
+    PyObject* py_packed = pbstats_records_dict(&pbstats.packed);
+    PyObject* py_parsed = py_packed ? pbstats_records_dict(&pbstats.parsed) : NULL;
+    if (py_parsed == NULL) {
+        Py_XDECREF(py_packed);
+        Py_DECREF(py_stages);
+        return NULL;
+    }
+    return Py_BuildValue("{s:N,s:N,s:N,s:K,s:K,s:K}", "stages", py_stages, "packed", py_packed, "parsed", py_parsed,
+                         "built", pbstats_get(&pbstats.built), "bytes_written", pbstats_get(&pbstats.bytes_written),
+                         "bytes_read", pbstats_get(&pbstats.bytes_read));
 }
 
+static PyObject* py_reset_stats(PyObject* self, PyObject* Py_UNUSED(ignored)) {
+    pbstats_reset();
+    Py_RETURN_NONE;
+}
+#endif
 
 static PyMethodDef PBMethods[] = {
-     {"deviceapps_xwrite_pb", py_deviceapps_xwrite_pb, METH_VARARGS, "Write serialized protobuf to file fro iterator"},
-     {"deviceapps_xread_pb", py_deviceapps_xread_pb, METH_VARARGS, "Deserialize protobuf from file, return iterator"},
+     {"deviceapps_xwrite_pb", (PyCFunction)(void(*)(void))py_deviceapps_xwrite_pb, METH_VARARGS | METH_KEYWORDS, "Write serialized protobuf to file fro iterator (packed=False, wide=False, checksum=False, threads=1, index=False, codec='gzip', block_size=262144, dictionary=None)"},
+     {"deviceapps_xwrite_sharded", (PyCFunction)(void(*)(void))py_deviceapps_xwrite_sharded, METH_VARARGS | METH_KEYWORDS, "Write serialized protobuf from iterator to shards files template.format(i), return list of (records, bytes) of shards; records are serialized on the calling thread, shards compressed on threads of their own (by='device.id' or 'round-robin', packed=False, wide=False, checksum=False, threads=1, index=False, codec='gzip', block_size=262144, dictionary=None, level=-1)"},
+     {"deviceapps_xread_pb", (PyCFunction)(void(*)(void))py_deviceapps_xread_pb, METH_VARARGS | METH_KEYWORDS, "Deserialize protobuf from file, return iterator (threads=1, start=0, stop=None, raw=False, recover=False, dictionary=None, types=None)"},
+     {"deviceapps_xread_columns", (PyCFunction)(void(*)(void))py_deviceapps_xread_columns, METH_VARARGS | METH_KEYWORDS, "Read protobuf file into columns (threads=1, start=0, stop=None, dictionary=None), return dict of buffers"},
+     {"deviceapps_xwrite_columns", (PyCFunction)(void(*)(void))py_deviceapps_xwrite_columns, METH_VARARGS | METH_KEYWORDS, "Write columns (buffers) as serialized protobuf to file (packed=False, wide=False, checksum=False, threads=1, index=False, codec='gzip', block_size=262144, dictionary=None)"},
+     {"deviceapps_encode", (PyCFunction)(void(*)(void))py_deviceapps_encode, METH_VARARGS | METH_KEYWORDS, "Serialize protobuf from iterator to bytes (packed=False, wide=False, checksum=False)"},
+#ifdef HAVE_ZSTD
+     {"deviceapps_train_dictionary", (PyCFunction)(void(*)(void))py_deviceapps_train_dictionary, METH_VARARGS | METH_KEYWORDS, "Train zstd dictionary on iterator of dicts, return bytes (size=112640, packed=False)"},
+#endif
+     {"deviceapps_decode", py_deviceapps_decode, METH_VARARGS, "Deserialize protobuf from bytes-like object, return list"},
+     {"crc32c", py_crc32c, METH_VARARGS, "CRC32C of bytes-like object (crc=0 of preceding data), as in records with checksum"},
+#ifdef PB_STATS
+     {"stats", py_stats, METH_NOARGS, "Return dict of instrumentation counters: time of stages, records, bytes, sizes of records"},
+     {"reset_stats", py_reset_stats, METH_NOARGS, "Reset instrumentation counters to zero"},
+#endif
      {NULL, NULL, 0, NULL}
 };
 
@@ -445,5 +4591,54 @@ static PyModuleDef PBModule = {
 };
 
 PyMODINIT_FUNC PyInit_pb(void) {
-    return PyModule_Create(&PBModule);
-}
\ No newline at end of file
+    pbcrc32c_init();
+    if (pbobjects_init() < 0)
+        return NULL;
+    if (PyType_Ready(&DeviceAppsIterType) < 0 || PyType_Ready(&DeviceAppsWriterType) < 0
+        || PyType_Ready(&PbColumnType) < 0)
+        return NULL;
+
+    PyObject* module = PyModule_Create(&PBModule);
+    if (module == NULL)
+        return NULL;
+
+    Py_INCREF(&DeviceAppsIterType);
+    if (PyModule_AddObject(module, "DeviceAppsIterator", (PyObject*)&DeviceAppsIterType) < 0) {
+        Py_DECREF(&DeviceAppsIterType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    Py_INCREF(&DeviceAppsWriterType);
+    if (PyModule_AddObject(module, "Writer", (PyObject*)&DeviceAppsWriterType) < 0) {
+        Py_DECREF(&DeviceAppsWriterType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    Py_INCREF(&PbColumnType);
+    if (PyModule_AddObject(module, "Column", (PyObject*)&PbColumnType) < 0) {
+        Py_DECREF(&PbColumnType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    // names of codecs built in, for codec= of writers
+    PyObject* py_codecs = PyTuple_New(PBCODECS_COUNT + 1);
+    if (py_codecs == NULL) {
+        Py_DECREF(module);
+        return NULL;
+    }
+    for (size_t i = 0; i <= PBCODECS_COUNT; i++) {
+        PyObject* py_name = PyUnicode_FromString(i < PBCODECS_COUNT ? pbcodecs[i].name : "none");
+        if (py_name == NULL) {
+            Py_DECREF(py_codecs);
+            Py_DECREF(module);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(py_codecs, i, py_name);
+    }
+    if (PyModule_AddObject(module, "codecs", py_codecs) < 0) {
+        Py_DECREF(py_codecs);
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
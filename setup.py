@@ -1,12 +1,42 @@
+import os
+import tempfile
+
 from setuptools import setup, Extension
+# distutils after setuptools: the distutils setuptools chose (its own or stdlib one), whose compiler raises
+# its CompileError
+from distutils.ccompiler import new_compiler
+from distutils.errors import CompileError
+from distutils.sysconfig import customize_compiler
+
+
+def have_header(header):
+    """Check that header of an optional library compiles (its -dev package is installed)."""
+    compiler = new_compiler()
+    customize_compiler(compiler)
+    with tempfile.TemporaryDirectory() as tmp:
+        source = os.path.join(tmp, "check.c")
+        with open(source, "w") as f:
+            f.write("#include <%s>\n" % header)
+        try:
+            compiler.compile([source], output_dir=tmp)
+        except CompileError:
+            return False
+    return True
+
+
+# Optional codecs: define, header, library
+codecs = [(define, library) for define, header, library in (
+    ("HAVE_ZSTD", "zstd.h", "zstd"),
+    ("HAVE_LZ4", "lz4frame.h", "lz4"),
+) if have_header(header)]
 
 module1 = Extension("pb",
                     sources=["pb.c", "deviceapps.pb-c.c"],
-                    extra_compile_args=["-g", "-DHAVE_ZLIB=1"],
-                    libraries=["protobuf-c"],
+                    extra_compile_args=["-g", "-DHAVE_ZLIB=1"] + ["-D%s=1" % define for define, _ in codecs],
+                    libraries=["protobuf-c"] + [library for _, library in codecs],
                     library_dirs=["/usr/lib"],
                     include_dirs=["/usr/include/google/protobuf-c/"],
-                    extra_link_args=['-lz'],                    
+                    extra_link_args=['-lz', '-lpthread'],                    
                     )
 
 setup(name="pb",
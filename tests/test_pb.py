@@ -1,7 +1,14 @@
+import array
+import ctypes
 import os
+import resource
 import unittest
 import gzip
 import struct
+import sys
+import threading
+import time
+import zlib
 
 import pb
 import deviceapps_pb2
@@ -9,6 +16,7 @@ import deviceapps_pb2
 
 MAGIC = 0xFFFFFFFF
 DEVICE_APPS_TYPE = 1
+DEVICE_APPS_PACKED_TYPE = 2
 TEST_FILE = "test.pb.gz"
 HEADER_SIZE = 8
 
@@ -22,7 +30,9 @@ class TestPB(unittest.TestCase):
     ]
 
     def tearDown(self):
-        os.remove(TEST_FILE)
+        for fname in (TEST_FILE, TEST_FILE + ".idx"):
+            if os.path.exists(fname):
+                os.remove(fname)
 
     def test_write(self):
         bytes_written = pb.deviceapps_xwrite_pb(self.deviceapps, TEST_FILE)
@@ -49,3 +59,824 @@ class TestPB(unittest.TestCase):
         pb.deviceapps_xwrite_pb(self.deviceapps, TEST_FILE)
         for i, d in enumerate(pb.deviceapps_xread_pb(TEST_FILE)):
             self.assertEqual(d, self.deviceapps[i])
+
+    def test_read_lazy(self):
+        pb.deviceapps_xwrite_pb(self.deviceapps, TEST_FILE)
+        it = pb.deviceapps_xread_pb(TEST_FILE)
+        self.assertIsInstance(it, pb.DeviceAppsIterator)
+        self.assertIs(iter(it), it)
+        self.assertEqual(next(it), self.deviceapps[0])
+        it.close()
+        self.assertRaises(StopIteration, next, it)
+        with pb.deviceapps_xread_pb(TEST_FILE) as it:
+            self.assertEqual(list(it), self.deviceapps)
+
+    def test_write_wire_format(self):
+        deviceapps = self.deviceapps + [
+            {"device": {"type": "idfa", "id": "x" * 300}, "apps": [0, 127, 128, 16383, 16384, 2 ** 32 - 1], "lat": -0.0},
+            {"device": {}, "lon": 1e-300},
+            {"apps": [], "lat": 55.75},
+        ]
+        pb.deviceapps_xwrite_pb(deviceapps, TEST_FILE)
+        with gzip.open(TEST_FILE) as zfile:
+            for deviceapp_orig in deviceapps:
+                _, _, length = struct.unpack('<IHH', zfile.read(HEADER_SIZE))
+                body = zfile.read(length)
+                deviceapp_expected = deviceapps_pb2.DeviceApps()
+                if "device" in deviceapp_orig:
+                    deviceapp_expected.device.SetInParent()
+                    for key, value in deviceapp_orig["device"].items():
+                        setattr(deviceapp_expected.device, key, value.encode())
+                deviceapp_expected.apps.extend(deviceapp_orig.get("apps", []))
+                for key in ("lat", "lon"):
+                    if key in deviceapp_orig:
+                        setattr(deviceapp_expected, key, deviceapp_orig[key])
+                self.assertEqual(body, deviceapp_expected.SerializeToString())
+
+    def write_raw(self, *bodies):
+        with gzip.open(TEST_FILE, "wb") as zfile:
+            for body in bodies:
+                zfile.write(struct.pack('<IHH', MAGIC, DEVICE_APPS_TYPE, len(body)) + body)
+
+    def test_read_wire_format(self):
+        # packed apps and unknown fields (varint, fixed32, length-delimited) are accepted
+        self.write_raw(
+            b'\x0a\x06\x0a\x01i\x12\x01t' + b'\x12\x03\x01\x80\x01' + b'\x10\x05'
+            + b'\x28\x07\x35\x00\x00\x00\x00\x3a\x01z' + b'\x19' + struct.pack('<d', 1.5),
+            b'',
+        )
+        self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE)), [
+            {"device": {"id": "i", "type": "t"}, "apps": [1, 128, 5], "lat": 1.5},
+            {"apps": []},
+        ])
+
+    def test_read_malformed(self):
+        for body in (b'\x12\x03\x01', b'\x10\x80', b'\x19\x00', b'\x0a\x02\x0a\x05', b'\x00\x01',
+                     b'\x11' + b'\x00' * 8, b'\x0a\x02\x0a\x01\xff', b'\x1b\x1c'):
+            self.write_raw(body)
+            with self.assertRaises(ValueError):
+                list(pb.deviceapps_xread_pb(TEST_FILE))
+
+    def test_write_packed(self):
+        deviceapps = self.deviceapps + [{"apps": list(range(0, 2 ** 32, 2 ** 20))}]
+        unpacked_bytes = pb.deviceapps_xwrite_pb(deviceapps, TEST_FILE)
+        packed_bytes = pb.deviceapps_xwrite_pb(deviceapps, TEST_FILE, packed=True)
+        self.assertLess(packed_bytes, unpacked_bytes)
+        with gzip.open(TEST_FILE) as zfile:
+            for deviceapp_orig in deviceapps:
+                magic, device_apps_type, length = struct.unpack('<IHH', zfile.read(HEADER_SIZE))
+                self.assertEqual((MAGIC, DEVICE_APPS_PACKED_TYPE), (magic, device_apps_type))
+                deviceapp_subj = deviceapps_pb2.DeviceApps()
+                deviceapp_subj.ParseFromString(zfile.read(length))
+                self.assertEqual(deviceapp_subj.apps, deviceapp_orig.get('apps', []))
+        self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE)), [dict(d, apps=d.get("apps", [])) for d in deviceapps])
+
+    def test_write_apps(self):
+        apps = [0, 1, 2 ** 31, 2 ** 32 - 1]
+        expected = pb.deviceapps_encode([{"apps": apps}])
+        for value in (tuple(apps), array.array("I", apps), memoryview(array.array("I", apps))):
+            self.assertEqual(pb.deviceapps_encode([{"apps": value}]), expected)
+            self.assertEqual(pb.deviceapps_encode([{"apps": value}], packed=True), pb.deviceapps_encode([{"apps": apps}], packed=True))
+        self.assertEqual(pb.deviceapps_encode([{"apps": [False, True, 2]}]), pb.deviceapps_encode([{"apps": [0, 1, 2]}]))
+        self.assertEqual(pb.deviceapps_decode(pb.deviceapps_encode([{"apps": array.array("I")}, {"apps": ()}])),
+                         [{"apps": []}, {"apps": []}])
+        for value in ([2 ** 32], (-1,), [2 ** 64], [-2 ** 70]):
+            with self.assertRaises(OverflowError, msg=value):
+                pb.deviceapps_encode([{"apps": value}])
+        for value in ([1.0], b"abcd", array.array("d", [1.0]), array.array("i", [1]), "12",
+                      memoryview(array.array("I", [1, 2, 3, 4])).cast("B").cast("I", (2, 2)), iter([1])):
+            with self.assertRaises(TypeError, msg=value):
+                pb.deviceapps_encode([{"apps": value}])
+
+    def test_write_threads(self):
+        deviceapps = [dict(d, apps=list(range(i % 100))) for i in range(5000) for d in self.deviceapps]
+        bytes_written = pb.deviceapps_xwrite_pb(deviceapps, TEST_FILE)
+        with gzip.open(TEST_FILE) as zfile:
+            raw = zfile.read()
+        self.assertEqual(pb.deviceapps_xwrite_pb(deviceapps, TEST_FILE, threads=4), bytes_written)
+        with gzip.open(TEST_FILE) as zfile:
+            self.assertEqual(zfile.read(), raw)
+        # independent gzip members, each holding whole records
+        with open(TEST_FILE, "rb") as f:
+            data = f.read()
+        members = 0
+        while data:
+            decompressor = zlib.decompressobj(zlib.MAX_WBITS | 16)
+            member = decompressor.decompress(data)
+            self.assertTrue(decompressor.eof)
+            while member:
+                _, _, length = struct.unpack('<IHH', member[:HEADER_SIZE])
+                self.assertGreaterEqual(len(member), HEADER_SIZE + length)
+                member = member[HEADER_SIZE + length:]
+            data = decompressor.unused_data
+            members += 1
+        self.assertGreater(members, 1)
+        self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE)), deviceapps)
+        self.assertRaises(ValueError, pb.deviceapps_xwrite_pb, deviceapps, TEST_FILE, threads=0)
+
+    def test_read_threads(self):
+        deviceapps = [dict(d, apps=list(range(i % 100))) for i in range(5000) for d in self.deviceapps]
+        pb.deviceapps_xwrite_pb(deviceapps, TEST_FILE, threads=3)
+        for threads in (2, 4):
+            self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE, threads=threads)), deviceapps)
+        pb.deviceapps_xwrite_pb(deviceapps, TEST_FILE)
+        with gzip.open(TEST_FILE) as zfile:
+            raw = zfile.read()
+        self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE, threads=2)), deviceapps)
+        # cat a.gz b.gz
+        with open(TEST_FILE, "rb") as f:
+            single = f.read()
+        with open(TEST_FILE, "ab") as f:
+            f.write(single)
+        self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE, threads=2)), deviceapps * 2)
+        # members split inside of records
+        with open(TEST_FILE, "wb") as f:
+            for start, end in ((0, 1001), (1001, 1003), (1003, 70001), (70001, len(raw))):
+                f.write(gzip.compress(raw[start:end]))
+        self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE, threads=2)), deviceapps)
+        # not gzipped at all
+        with open(TEST_FILE, "wb") as f:
+            f.write(raw)
+        self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE, threads=2)), deviceapps)
+        self.assertRaises(ValueError, pb.deviceapps_xread_pb, TEST_FILE, threads=0)
+
+    def test_read_threads_fake_member(self):
+        # stored (level 0) deflate keeps gzip header lookalike of packed apps as is
+        deviceapps = [{"apps": [0x1f, 0x0b | 0x08 << 7, 0, 0, 0, 0, 0, 0, 3]}] * 100
+        pb.deviceapps_xwrite_pb(deviceapps, TEST_FILE, packed=True)
+        with gzip.open(TEST_FILE) as zfile:
+            raw = zfile.read()
+        self.assertIn(b"\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\x03", raw)
+        with open(TEST_FILE, "wb") as f:
+            f.write(gzip.compress(raw, compresslevel=0) + gzip.compress(raw, compresslevel=0))
+        self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE, threads=2)), deviceapps * 2)
+
+    def test_read_threads_truncated(self):
+        pb.deviceapps_xwrite_pb(self.deviceapps, TEST_FILE)
+        with gzip.open(TEST_FILE) as zfile:
+            raw = zfile.read()
+        with open(TEST_FILE, "wb") as f:
+            f.write(gzip.compress(raw) + gzip.compress(raw[:-3]))
+        it = pb.deviceapps_xread_pb(TEST_FILE, threads=2)
+        expected = (self.deviceapps * 2)[:-1]
+        self.assertEqual([next(it) for _ in expected], expected)
+        self.assertRaises(ValueError, next, it)
+
+    def big_deviceapps(self, n=20000):
+        return [{"device": {"type": "idfa", "id": "%032x" % (i * 7919)}, "lat": i / 7.0, "lon": -i / 3.0,
+                 "apps": list(range(i % 50, i % 50 + i % 150))} for i in range(n)]
+
+    def ticks_during(self, func):
+        """Run func and count how many times another Python thread got the GIL meanwhile."""
+        ticks, stop = [0], threading.Event()
+
+        def ticker():
+            while not stop.is_set():
+                time.sleep(0.0005)
+                ticks[0] += 1
+        thread = threading.Thread(target=ticker)
+        thread.start()
+        time.sleep(0.01)
+        before = ticks[0]
+        result = func()
+        after = ticks[0]
+        stop.set()
+        thread.join()
+        return after - before, result
+
+    def test_gil_released(self):
+        deviceapps = self.big_deviceapps()
+        for threads in (1, 2):
+            ticks, _ = self.ticks_during(lambda: pb.deviceapps_xwrite_pb(deviceapps, TEST_FILE, threads=threads))
+            self.assertGreater(ticks, 5)
+            ticks, result = self.ticks_during(lambda: list(pb.deviceapps_xread_pb(TEST_FILE, threads=threads)))
+            self.assertGreater(ticks, 5)
+            self.assertEqual(result, deviceapps)
+        it = pb.deviceapps_xread_pb(TEST_FILE)
+        errors = []
+
+        def consume():
+            try:
+                for _ in it:
+                    pass
+            except ValueError as e:  # iterator already executing
+                errors.append(e)
+        threads = [threading.Thread(target=consume) for _ in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertRaises(StopIteration, next, it)
+
+    def test_threads_overlap(self):
+        # another writer goes on while one is in its call: it gets the GIL only when the writer releases it,
+        # as the long switch interval does not take it away and records of a list run no Python code
+        deviceapps = self.big_deviceapps()
+        files = [TEST_FILE + ".%d" % i for i in range(2)]
+        written, stop = [0], threading.Event()
+
+        def records():
+            while not stop.is_set():
+                yield deviceapps[written[0] % len(deviceapps)]
+                written[0] += 1
+        other = threading.Thread(target=pb.deviceapps_xwrite_pb, args=(records(), files[1]))
+        interval = sys.getswitchinterval()
+        sys.setswitchinterval(10)
+        try:
+            other.start()
+            while not written[0]:
+                time.sleep(0.001)
+            before = written[0]
+            pb.deviceapps_xwrite_pb(deviceapps, files[0])
+            after = written[0]
+        finally:
+            sys.setswitchinterval(interval)
+            stop.set()
+            other.join()
+        try:
+            self.assertGreater(after - before, 0)
+            self.assertEqual(list(pb.deviceapps_xread_pb(files[0])), deviceapps)
+            self.assertEqual(sum(1 for _ in pb.deviceapps_xread_pb(files[1])), written[0])
+        finally:
+            for fname in files:
+                os.remove(fname)
+
+    @unittest.skipUnless(os.environ.get("PB_TEST_TIMING"), "timing test, set PB_TEST_TIMING=1 to run it")
+    def test_threads_speedup(self):
+        if (os.cpu_count() or 1) < 2:
+            self.skipTest("needs 2+ cores")
+        deviceapps = self.big_deviceapps(40000)
+        files = [TEST_FILE + ".%d" % i for i in range(2)]
+
+        def work(fname):
+            pb.deviceapps_xwrite_pb(deviceapps, fname)
+            self.assertEqual(sum(1 for _ in pb.deviceapps_xread_pb(fname)), len(deviceapps))
+        try:
+            started = time.perf_counter()
+            for fname in files:
+                work(fname)
+            serial = time.perf_counter() - started
+            threads = [threading.Thread(target=work, args=(fname,)) for fname in files]
+            started = time.perf_counter()
+            for thread in threads:
+                thread.start()
+            for thread in threads:
+                thread.join()
+            concurrent = time.perf_counter() - started
+        finally:
+            for fname in files:
+                if os.path.exists(fname):
+                    os.remove(fname)
+        self.assertLess(concurrent, serial * 0.95)
+
+    def test_encode_decode(self):
+        data = pb.deviceapps_encode(iter(self.deviceapps))
+        self.assertIsInstance(data, bytes)
+        self.assertEqual(len(data), pb.deviceapps_xwrite_pb(self.deviceapps, TEST_FILE))
+        with gzip.open(TEST_FILE) as zfile:
+            self.assertEqual(data, zfile.read())
+        self.assertEqual(pb.deviceapps_decode(data), self.deviceapps)
+        self.assertEqual(pb.deviceapps_decode(memoryview(bytearray(data))), self.deviceapps)
+        packed = pb.deviceapps_encode(self.deviceapps, packed=True)
+        self.assertEqual(struct.unpack('<IHH', packed[:HEADER_SIZE])[1], DEVICE_APPS_PACKED_TYPE)
+        self.assertEqual(pb.deviceapps_decode(packed), self.deviceapps)
+        self.assertEqual(pb.deviceapps_encode([]), b"")
+        self.assertEqual(pb.deviceapps_decode(b""), [])
+        self.assertRaises(ValueError, pb.deviceapps_decode, data[:-1])
+        self.assertRaises(TypeError, pb.deviceapps_decode, "text")
+        self.assertRaises(TypeError, pb.deviceapps_encode, [{"apps": "1"}])
+
+        # device types are cached strings, whatever their number and length
+        deviceapps = [{"device": {"type": t}, "apps": []} for t in ["idfa", "gaid"] * 2 + ["t%d" % i for i in range(300)]
+                      + ["ä" * 8, "x" * 17]]
+        decoded = pb.deviceapps_decode(pb.deviceapps_encode(deviceapps))
+        self.assertEqual(decoded, deviceapps)
+        self.assertIs(decoded[0]["device"]["type"], decoded[2]["device"]["type"])
+
+    def test_wide_header(self):
+        big = {"device": {"type": "idfa", "id": "aggregated"}, "lat": 1.5, "apps": list(range(100000))}
+        deviceapps = self.deviceapps[:1] + [big] + self.deviceapps[1:]
+        data = pb.deviceapps_encode(deviceapps)
+        # the first record keeps pbheader_t, the long one gets the wide header: type | 0x8000, length 0, uint32 length
+        _, _, length = struct.unpack('<IHH', data[:HEADER_SIZE])
+        magic, device_apps_type, zero, wide_length = struct.unpack('<IHHI', data[HEADER_SIZE + length:][:HEADER_SIZE + 4])
+        self.assertEqual((magic, device_apps_type, zero), (MAGIC, DEVICE_APPS_TYPE | 0x8000, 0))
+        self.assertGreater(wide_length, 0xFFFF)
+        message = deviceapps_pb2.DeviceApps()
+        message.ParseFromString(data[2 * HEADER_SIZE + 4 + length:][:wide_length])
+        self.assertEqual(len(message.apps), 100000)
+        self.assertEqual(pb.deviceapps_decode(data), deviceapps)
+        for packed in (False, True):
+            wide = pb.deviceapps_encode(self.deviceapps, packed=packed, wide=True)
+            self.assertEqual(len(wide), len(pb.deviceapps_encode(self.deviceapps, packed=packed)) + 4 * len(self.deviceapps))
+            self.assertEqual(pb.deviceapps_decode(wide), self.deviceapps)
+
+        for codec in ("gzip", "none"):
+            for threads in (1, 2):
+                pb.deviceapps_xwrite_pb(deviceapps, TEST_FILE, codec=codec, threads=threads, index=codec != "none")
+                self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE, threads=threads)), deviceapps)
+                self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE, start=1, stop=2)), [big])
+                self.assertEqual(b"".join(pb.deviceapps_xread_pb(TEST_FILE, raw=True)), data)
+                columns = pb.deviceapps_xread_columns(TEST_FILE, threads=threads)
+                self.assertEqual(len(columns["apps"]), sum(len(d.get("apps", [])) for d in deviceapps))
+        self.assertEqual(pb.deviceapps_xwrite_columns(TEST_FILE, **columns), len(data))
+        self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE)), deviceapps)
+
+    def test_checksum_recover(self):
+        def crc32c(data):
+            crc = 0xFFFFFFFF
+            for byte in data:
+                crc ^= byte
+                for _ in range(8):
+                    crc = (crc >> 1) ^ 0x82F63B78 if crc & 1 else crc >> 1
+            return crc ^ 0xFFFFFFFF
+        for n in (0, 1, 7, 8, 9, 100):
+            data = bytes(range(n))
+            self.assertEqual(pb.crc32c(data), crc32c(data))
+        self.assertEqual(pb.crc32c(b"123456789"), 0xE3069283)
+
+        deviceapps = self.big_deviceapps(200)
+        data = pb.deviceapps_encode(deviceapps, checksum=True)
+        self.assertEqual(len(data), len(pb.deviceapps_encode(deviceapps)) + 4 * len(deviceapps))
+        magic, device_apps_type, length, crc = struct.unpack('<IHHI', data[:HEADER_SIZE + 4])
+        self.assertEqual(device_apps_type, DEVICE_APPS_TYPE | 0x4000)
+        self.assertEqual(crc, crc32c(data[HEADER_SIZE + 4:][:length]))
+        self.assertEqual(pb.deviceapps_decode(data), pb.deviceapps_decode(pb.deviceapps_encode(deviceapps)))
+        wide = pb.deviceapps_encode(deviceapps[:1], checksum=True, wide=True)
+        self.assertEqual(struct.unpack('<IHHII', wide[:HEADER_SIZE + 8])[1:4], (DEVICE_APPS_TYPE | 0xC000, 0, length))
+        self.assertEqual(pb.deviceapps_decode(wide), pb.deviceapps_decode(data)[:1])
+
+        # damage the 11th record (a flipped byte) and the 101st (garbage in its middle), cut the last one
+        offsets = [0]
+        for record in deviceapps:
+            offsets.append(offsets[-1] + len(pb.deviceapps_encode([record], checksum=True)))
+        flipped = bytearray(data)
+        flipped[offsets[10] + 20] ^= 1
+        damaged = bytes(flipped[:offsets[100] + 20]) + b"\x00garbage" + bytes(flipped[offsets[100] + 20:offsets[-1] - 5])
+        expected = [r for i, r in enumerate(pb.deviceapps_decode(data)) if i not in (10, 100, 199)]
+        kept = sum(offsets[i + 1] - offsets[i] for i in range(len(deviceapps)) if i not in (10, 100, 199))
+        for content in (damaged, gzip.compress(damaged)):
+            with open(TEST_FILE, "wb") as f:
+                f.write(content)
+            for threads in (1, 2):
+                with self.assertRaises(ValueError):
+                    list(pb.deviceapps_xread_pb(TEST_FILE, threads=threads))
+                it = pb.deviceapps_xread_pb(TEST_FILE, threads=threads, recover=True)
+                self.assertEqual(list(it), expected)
+                self.assertEqual((it.skipped_records, it.skipped_bytes), (3, len(damaged) - kept))
+
+        # truncated compressed stream ends reading, the incomplete record is reported
+        pb.deviceapps_xwrite_pb(deviceapps, TEST_FILE, checksum=True)
+        with open(TEST_FILE, "rb") as f:
+            content = f.read()
+        with open(TEST_FILE, "wb") as f:
+            f.write(content[:len(content) // 2])
+        it = pb.deviceapps_xread_pb(TEST_FILE, recover=True)
+        records = list(it)
+        self.assertGreater(len(records), 0)
+        self.assertEqual(records, pb.deviceapps_decode(data)[:len(records)])
+        self.assertLessEqual(it.skipped_records, 1)
+
+        # MAGIC inside of a message is no record to resync on, in a skipped type neither
+        deviceapps = self.big_deviceapps(1000)
+        deviceapps[5]["apps"] = [0xFFFFFFFF, 1, 1, 1]
+        records = [pb.deviceapps_encode([record], checksum=True) for record in deviceapps]
+        damaged = bytearray(b"".join(records))
+        damaged[sum(map(len, records[:5]))] = 0
+        expected = pb.deviceapps_decode(b"".join(records[:5] + records[6:]))
+        for codec in ("none", "gzip"):
+            with open(TEST_FILE, "wb") as f:
+                f.write(damaged if codec == "none" else gzip.compress(damaged))
+            for types in (None, {2}):
+                it = pb.deviceapps_xread_pb(TEST_FILE, recover=True, types=types)
+                self.assertEqual(list(it), expected if types is None else [])
+                self.assertEqual((it.skipped_records, it.skipped_bytes), (1, len(records[5])))
+
+        # every damaged record of a span is counted, not the span
+        damaged = bytearray(b"".join(records))
+        for i in (20, 21, 22):
+            damaged[sum(map(len, records[:i])) + 20] ^= 1
+        with open(TEST_FILE, "wb") as f:
+            f.write(damaged)
+        it = pb.deviceapps_xread_pb(TEST_FILE, recover=True)
+        self.assertEqual(list(it), pb.deviceapps_decode(b"".join(records[:20] + records[23:])))
+        self.assertEqual((it.skipped_records, it.skipped_bytes), (3, sum(map(len, records[20:23]))))
+
+        # damaged wide length is skipped as soon as the next record is read, not after buffering the rest of file
+        records = [pb.deviceapps_encode([record], checksum=True, wide=True) for record in deviceapps[:20]]
+        damaged = bytearray(b"".join(records))
+        offset = sum(map(len, records[:10])) + HEADER_SIZE
+        damaged[offset:offset + 4] = struct.pack("=I", 0xFFFFFF00)
+        expected = pb.deviceapps_decode(b"".join(records[:10] + records[11:]))
+        filler = gzip.compress(b"".join(records[11:]) * (1024 * 1024 // len(b"".join(records[11:]))), 1)
+        with open(TEST_FILE, "wb") as f:
+            f.write(gzip.compress(bytes(damaged)))
+        it = pb.deviceapps_xread_pb(TEST_FILE, recover=True)
+        self.assertEqual(list(it), expected)
+        self.assertEqual((it.skipped_records, it.skipped_bytes), (1, len(records[10])))
+        with open(TEST_FILE, "ab") as f:
+            f.write(filler * 256)
+        rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+        it = pb.deviceapps_xread_pb(TEST_FILE, recover=True)
+        self.assertEqual([next(it) for _ in expected], expected)
+        self.assertLess(resource.getrusage(resource.RUSAGE_SELF).ru_maxrss - rss, 64 * 1024)  # of 256 MB
+        del it
+
+    def test_read_columns(self):
+        deviceapps = self.deviceapps + [{"device": {"id": "x"}, "apps": [7]}, {"device": {}, "lon": 1.5}, {}] * 3
+        pb.deviceapps_xwrite_pb(deviceapps, TEST_FILE)
+        for threads in (1, 2):
+            columns = pb.deviceapps_xread_columns(TEST_FILE, threads=threads)
+            n = columns["count"]
+            self.assertEqual(n, len(deviceapps))
+            self.assertIsInstance(columns["lat"], pb.Column)
+            self.assertEqual(memoryview(columns["lat"]).format, "d")
+            lat, lon = memoryview(columns["lat"]).tolist(), memoryview(columns["lon"]).tolist()
+            apps, apps_offsets = memoryview(columns["apps"]).tolist(), memoryview(columns["apps_offsets"]).tolist()
+            self.assertEqual(len(apps_offsets), n + 1)
+
+            def bit(name, i):
+                return bool(memoryview(columns[name])[i // 8] >> (i % 8) & 1)
+
+            def blob(name, i):
+                offsets = memoryview(columns[name + "_offsets"]).tolist()
+                return bytes(memoryview(columns[name])[offsets[i]:offsets[i + 1]]).decode()
+
+            for i, d in enumerate(deviceapps):
+                self.assertEqual(apps[apps_offsets[i]:apps_offsets[i + 1]], d.get("apps", []))
+                self.assertEqual((bit("has_lat", i), lat[i]), ("lat" in d, d.get("lat", 0)))
+                self.assertEqual((bit("has_lon", i), lon[i]), ("lon" in d, d.get("lon", 0)))
+                device = d.get("device")
+                self.assertEqual(bit("has_device", i), device is not None)
+                for key in ("id", "type"):
+                    self.assertEqual(bit("has_device_" + key, i), key in (device or {}))
+                    self.assertEqual(blob("device_" + key, i), (device or {}).get(key, ""))
+        open(TEST_FILE, "wb").close()
+        columns = pb.deviceapps_xread_columns(TEST_FILE)
+        self.assertEqual((columns["count"], len(columns["lat"]), len(columns["apps_offsets"])), (0, 0, 1))
+
+    def test_read_range(self):
+        deviceapps = self.big_deviceapps(5000)
+        for threads in (1, 2):
+            pb.deviceapps_xwrite_pb(deviceapps, TEST_FILE, threads=threads, index=True)
+            with open(TEST_FILE + ".idx", "rb") as f:
+                magic, version, n_entries, check = struct.unpack("=4sIQQ", f.read(24))
+                entries = [struct.unpack("=QQQ", f.read(24)) for _ in range(n_entries)]
+            with open(TEST_FILE, "rb") as f:
+                content = f.read()
+            self.assertEqual((magic, version), (b"PBIX", 2))
+            self.assertEqual(check, pb.crc32c(content[-4096:], pb.crc32c(content[:4096])))
+            self.assertGreater(n_entries, 2)
+            self.assertEqual(entries[0], (0, 0, 0))
+            self.assertEqual(entries[-1][0], len(deviceapps))
+            self.assertEqual(entries[-1][2], os.path.getsize(TEST_FILE))
+            with gzip.open(TEST_FILE) as f:
+                self.assertEqual(len(f.read()), entries[-1][1])
+            for start, stop in ((0, None), (1, 3), (entries[1][0], entries[2][0] + 1), (4990, None), (4000, 10),
+                                (6000, None), (0, 0)):
+                expected = deviceapps[start:stop]
+                for read_threads in (1, 2):
+                    records = list(pb.deviceapps_xread_pb(TEST_FILE, threads=read_threads, start=start, stop=stop))
+                    self.assertEqual(records, expected)
+                columns = pb.deviceapps_xread_columns(TEST_FILE, start=start, stop=stop)
+                self.assertEqual(columns["count"], len(expected))
+                self.assertEqual(memoryview(columns["lat"]).tolist(), [d["lat"] for d in expected])
+        # index of other contents of the same size (here its records are off by one) is not used:
+        # it is used with the file it was written with, but not after the file changes (mtime of gzip header)
+        start = entries[2][0] + 1
+        with open(TEST_FILE + ".idx", "wb") as f:
+            f.write(struct.pack("=4sIQQ", magic, version, n_entries, check))
+            f.write(b"".join(struct.pack("=QQQ", record + 1, offset, zoffset) for record, offset, zoffset in entries))
+        self.assertNotEqual(list(pb.deviceapps_xread_pb(TEST_FILE, start=start)), deviceapps[start:])
+        with open(TEST_FILE, "r+b") as f:
+            f.seek(4)
+            f.write(b"\x01\x02\x03\x04")
+        self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE, start=start)), deviceapps[start:])
+        # rewriting without index drops the old one, ranges are read by skipping then
+        pb.deviceapps_xwrite_pb(deviceapps[:10], TEST_FILE)
+        self.assertFalse(os.path.exists(TEST_FILE + ".idx"))
+        self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE, start=7)), deviceapps[7:10])
+        with self.assertRaises(ValueError):
+            pb.deviceapps_xread_pb(TEST_FILE, start=-1)
+
+    def test_read_uncompressed(self):
+        deviceapps = self.deviceapps + self.big_deviceapps(3000)
+        size = pb.deviceapps_xwrite_pb(deviceapps, TEST_FILE, codec="none")
+        with open(TEST_FILE, "rb") as f:
+            data = f.read()
+        self.assertEqual(size, len(data))
+        self.assertEqual(data, pb.deviceapps_encode(deviceapps))
+        expected = pb.deviceapps_decode(data)
+        for threads in (1, 2):
+            self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE, threads=threads)), expected)
+        self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE, start=2000, stop=2005)), expected[2000:2005])
+        self.assertEqual(pb.deviceapps_xread_columns(TEST_FILE, start=5)["count"], len(expected) - 5)
+
+        records = list(pb.deviceapps_xread_pb(TEST_FILE, raw=True))
+        self.assertIsInstance(records[0], memoryview)
+        self.assertTrue(records[0].readonly)
+        self.assertEqual(b"".join(records), data)  # slices outlive the iterator
+        self.assertEqual(pb.deviceapps_decode(records[3]), expected[3:4])
+        pb.deviceapps_xwrite_pb(self.deviceapps, TEST_FILE)
+        self.assertEqual(b"".join(pb.deviceapps_xread_pb(TEST_FILE, raw=True)), pb.deviceapps_encode(self.deviceapps))
+
+        with open(TEST_FILE, "wb") as f:
+            f.write(data[:-1])
+        with self.assertRaises(ValueError):
+            list(pb.deviceapps_xread_pb(TEST_FILE))
+        with self.assertRaises(ValueError):
+            pb.deviceapps_xwrite_pb(self.deviceapps, TEST_FILE, codec="bz2")
+        with self.assertRaises(ValueError):
+            pb.deviceapps_xwrite_pb(self.deviceapps, TEST_FILE, codec="none", index=True)
+
+    def test_codecs(self):
+        deviceapps = self.deviceapps + self.big_deviceapps(3000)
+        magics = {"gzip": b"\x1f\x8b", "zstd": b"\x28\xb5\x2f\xfd", "lz4": b"\x04\x22\x4d\x18", "none": b"\xff\xff\xff\xff"}
+        self.assertIn("gzip", pb.codecs)
+        self.assertIn("none", pb.codecs)
+        for codec in pb.codecs:
+            for threads in (1, 2):
+                size = pb.deviceapps_xwrite_pb(deviceapps, TEST_FILE, threads=threads, index=codec != "none", codec=codec)
+                self.assertEqual(size, len(pb.deviceapps_encode(deviceapps)))
+                with open(TEST_FILE, "rb") as f:
+                    data = f.read()
+                self.assertTrue(data.startswith(magics[codec]), codec)
+                self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE)), list(pb.deviceapps_xread_pb(TEST_FILE, threads=2)))
+                self.assertEqual(len(list(pb.deviceapps_xread_pb(TEST_FILE))), len(deviceapps))
+                self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE, start=2500, stop=2503)),
+                                 list(pb.deviceapps_xread_pb(TEST_FILE))[2500:2503])
+            # gzread accepts missing gzip trailer and trailing garbage, frame codecs do not
+            broken = [data[:len(data) // 2]] + ([data[:-3], data + b"garbage"] if codec not in ("none", "gzip") else [])
+            for content in broken:
+                with open(TEST_FILE, "wb") as f:
+                    f.write(content)
+                with self.assertRaises(ValueError, msg=codec):
+                    list(pb.deviceapps_xread_pb(TEST_FILE))
+
+    @unittest.skipUnless("zstd" in pb.codecs, "zstd is not built in")
+    def test_dictionary(self):
+        deviceapps = self.big_deviceapps(3000)
+        dictionary = pb.deviceapps_train_dictionary(deviceapps[:2000], size=16384)
+        self.assertLessEqual(len(dictionary), 16384)
+        sizes = {}
+        for d in (None, dictionary):
+            # a frame per record
+            kwargs = {"dictionary": d} if d else {}
+            pb.deviceapps_xwrite_pb(deviceapps, TEST_FILE, codec="zstd", block_size=1, index=True, **kwargs)
+            sizes[d] = os.path.getsize(TEST_FILE)
+            self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE, **kwargs)), list(pb.deviceapps_decode(pb.deviceapps_encode(deviceapps))))
+            self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE, start=2500, stop=2502, **kwargs)),
+                             list(pb.deviceapps_xread_pb(TEST_FILE, **kwargs))[2500:2502])
+        self.assertLess(sizes[dictionary], sizes[None] * 0.6)
+        columns = pb.deviceapps_xread_columns(TEST_FILE, dictionary=dictionary)
+        self.assertEqual(columns["count"], len(deviceapps))
+        pb.deviceapps_xwrite_columns(TEST_FILE, codec="zstd", block_size=100, dictionary=dictionary, **columns)
+        self.assertEqual(len(list(pb.deviceapps_xread_pb(TEST_FILE, dictionary=dictionary))), len(deviceapps))
+
+        with self.assertRaises(ValueError):
+            pb.deviceapps_xread_pb(TEST_FILE)
+        with self.assertRaises(ValueError):
+            pb.deviceapps_xread_pb(TEST_FILE, dictionary=pb.deviceapps_train_dictionary(deviceapps[1000:], size=4096))
+        for codec in ("gzip", "none"):
+            with self.assertRaises(ValueError):
+                pb.deviceapps_xwrite_pb(deviceapps, TEST_FILE, codec=codec, dictionary=dictionary)
+        with self.assertRaises(ValueError):
+            pb.deviceapps_xwrite_pb(deviceapps, TEST_FILE, codec="zstd", dictionary=b"raw content")
+        with self.assertRaises(ValueError):
+            pb.deviceapps_xwrite_pb(deviceapps, TEST_FILE, block_size=0)
+        with self.assertRaises(ValueError):
+            pb.deviceapps_train_dictionary(deviceapps[:3])
+
+    def test_write_columns(self):
+        deviceapps = self.deviceapps + [{"device": {"id": "x"}, "apps": [7]}, {"device": {}, "lon": 1.5}, {}] * 3
+        pb.deviceapps_xwrite_pb(deviceapps, TEST_FILE)
+        with gzip.open(TEST_FILE) as f:
+            expected = f.read()
+        records = list(pb.deviceapps_xread_pb(TEST_FILE))
+        columns = pb.deviceapps_xread_columns(TEST_FILE)
+        for threads in (1, 2):
+            size = pb.deviceapps_xwrite_columns(TEST_FILE, threads=threads, **columns)
+            self.assertEqual(size, len(expected))
+            with gzip.open(TEST_FILE) as f:
+                self.assertEqual(f.read(), expected)
+        self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE)), records)
+
+        # plain buffers, missing bitmaps mean all present
+        pb.deviceapps_xwrite_columns(TEST_FILE, lat=array.array("d", [1.0, 2.0]), apps=array.array("I", [1, 2, 3]),
+                                     apps_offsets=array.array("q", [0, 1, 3]), device_id=b"ab",
+                                     device_id_offsets=array.array("q", [0, 0, 2]))
+        self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE)),
+                         [{"device": {"id": ""}, "lat": 1.0, "apps": [1]},
+                          {"device": {"id": "ab"}, "lat": 2.0, "apps": [2, 3]}])
+        self.assertEqual(pb.deviceapps_xwrite_columns(TEST_FILE, count=0), 0)
+        with self.assertRaises(ValueError):
+            pb.deviceapps_xwrite_columns(TEST_FILE, apps=array.array("I", [1]), apps_offsets=array.array("q", [0, 2]))
+        with self.assertRaises(ValueError):
+            pb.deviceapps_xwrite_columns(TEST_FILE, lat=array.array("d", [1.0]), lon=array.array("d", [1.0, 2.0]))
+        with self.assertRaises(ValueError):
+            pb.deviceapps_xwrite_columns(TEST_FILE, has_lat=b"\x01")
+        with self.assertRaises(TypeError):
+            pb.deviceapps_xwrite_columns(TEST_FILE, lat=array.array("f", [1.0]))
+        for apps in (array.array("i", [1]), array.array("l", [1]), array.array("q", [1]),
+                     (ctypes.c_uint32.__ctype_be__ * 1)(1) if sys.byteorder == "little" else (ctypes.c_uint32.__ctype_le__ * 1)(1)):
+            with self.assertRaises(TypeError, msg=memoryview(apps).format):
+                pb.deviceapps_xwrite_columns(TEST_FILE, apps=apps, apps_offsets=array.array("q", [0, 1]))
+        with self.assertRaises(TypeError):
+            pb.deviceapps_xwrite_columns(TEST_FILE, lat=(ctypes.c_double.__ctype_be__ * 1)(1.0) if sys.byteorder == "little"
+                                         else (ctypes.c_double.__ctype_le__ * 1)(1.0))
+        # explicit native byte order is taken
+        pb.deviceapps_xwrite_columns(TEST_FILE, apps=(ctypes.c_uint32 * 2)(1, 2), apps_offsets=array.array("q", [0, 2]))
+        self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE)), [{"apps": [1, 2]}])
+
+    def test_writer(self):
+        deviceapps = self.deviceapps + self.big_deviceapps(3000)
+        expected = pb.deviceapps_encode(deviceapps, checksum=True)
+        for codec in pb.codecs:
+            for threads in (1, 2):
+                with pb.Writer(TEST_FILE, codec=codec, threads=threads, checksum=True) as writer:
+                    self.assertEqual(writer.write(deviceapps[0]), len(pb.deviceapps_encode(deviceapps[:1], checksum=True)))
+                    self.assertEqual(writer.write_many(iter(deviceapps[1:1000] + [None])),
+                                     len(pb.deviceapps_encode(deviceapps[1:1000], checksum=True)))
+                    # a reader tailing the file sees whole records after flush
+                    writer.flush()
+                    with open(TEST_FILE, "rb") as f:
+                        data = f.read()
+                    if codec == "gzip":
+                        data = zlib.decompressobj(16 + zlib.MAX_WBITS).decompress(data)
+                    elif codec != "none":
+                        data = pb.deviceapps_encode(pb.deviceapps_xread_pb(TEST_FILE), checksum=True)
+                    self.assertEqual(data, expected[:len(data)], codec)
+                    self.assertEqual(pb.deviceapps_decode(data), pb.deviceapps_decode(expected)[:1000], codec)
+                    for d in deviceapps[1000:]:
+                        writer.write(d)
+                self.assertTrue(writer.closed)
+                self.assertEqual(writer.bytes_written, len(expected))
+                self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE)), pb.deviceapps_decode(expected))
+
+        sizes = {}
+        for level in (0, 9):
+            writer = pb.Writer(TEST_FILE, level=level, buffer_size=1 << 20, block_size=1000)
+            writer.write_many(deviceapps)
+            writer.close()
+            writer.close()
+            sizes[level] = os.path.getsize(TEST_FILE)
+            self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE)), pb.deviceapps_decode(pb.deviceapps_encode(deviceapps)))
+        self.assertLess(sizes[9], sizes[0] / 2)
+        with self.assertRaises(ValueError):
+            writer.write(deviceapps[0])
+        with self.assertRaises(ValueError):
+            writer.flush()
+
+        writer = pb.Writer(TEST_FILE)
+        with self.assertRaises(TypeError):
+            writer.write([])
+        with self.assertRaises(TypeError):
+            writer.write({"apps": ["x"]})
+
+        def reentrant():
+            yield deviceapps[0]
+            writer.write(deviceapps[1])
+        with self.assertRaises(ValueError):
+            writer.write_many(reentrant())
+        writer.write(deviceapps[2])
+        del writer  # closed on release
+        self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE)), [deviceapps[0], deviceapps[2]])
+        for kwargs in ({"codec": "none", "level": 1}, {"level": 10}, {"buffer_size": -1}, {"codec": "bz2"}):
+            with self.assertRaises(ValueError, msg=kwargs):
+                pb.Writer(TEST_FILE, **kwargs)
+        if "lz4" in pb.codecs:
+            with self.assertRaises(ValueError):
+                pb.Writer(TEST_FILE, codec="lz4", level=1)
+        with self.assertRaises(OSError):
+            pb.Writer("/nonexistent/" + TEST_FILE)
+
+    def test_read_types(self):
+        deviceapps = self.deviceapps + self.big_deviceapps(100)
+        foreign = [struct.pack("<IHH", MAGIC, 7, 3) + b"abc",
+                   struct.pack("<IHHI", MAGIC, 9 | 0x8000, 0, 300000) + b"\x00" * 300000,  # longer than a read chunk
+                   struct.pack("<IHHI", MAGIC, 7 | 0x4000, 2, pb.crc32c(b"ok")) + b"ok"]
+        unchecked = struct.pack("<IHHI", MAGIC, 8 | 0x4000, 2, 0) + b"no"  # wrong checksum of unwanted record
+        records = [pb.deviceapps_encode([d], packed=i % 2 == 1) for i, d in enumerate(deviceapps)]
+        stream = records[:50] + foreign[:2] + records[50:70] + [unchecked] + foreign[2:] + records[70:] + foreign[1:2]
+        data = b"".join(stream)
+        self.assertEqual(pb.deviceapps_decode(data), deviceapps)
+        for compress in (gzip.compress, lambda data: data):
+            with open(TEST_FILE, "wb") as f:
+                f.write(compress(data))
+            for threads in (1, 2):
+                self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE, threads=threads)), deviceapps)
+                self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE, threads=threads, types={1})), deviceapps[::2])
+                self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE, threads=threads, types=[2], start=20, stop=30)),
+                                 deviceapps[1::2][20:30])
+                self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE, threads=threads, types=())), [])
+                self.assertEqual([bytes(r) for r in pb.deviceapps_xread_pb(TEST_FILE, threads=threads, raw=True, types={7, 9})],
+                                 foreign + foreign[1:2])
+                self.assertEqual([bytes(r) for r in pb.deviceapps_xread_pb(TEST_FILE, threads=threads, raw=True, types={1, 7})],
+                                 [r for r in stream if r[4] == 1 or r[4] == 7])
+            # the file ends inside of skipped record
+            with open(TEST_FILE, "wb") as f:
+                f.write(compress(data[:-1000]))
+            with self.assertRaises(ValueError):
+                list(pb.deviceapps_xread_pb(TEST_FILE))
+            self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE, recover=True)), deviceapps)
+
+        for types in ({7}, {-1}, {0x4000}, "a"):
+            with self.assertRaises((ValueError, TypeError), msg=types):
+                pb.deviceapps_xread_pb(TEST_FILE, types=types)
+
+    @unittest.skipUnless(hasattr(pb, "stats"), "built without PB_STATS")
+    def test_stats(self):
+        deviceapps = [dict(self.deviceapps[0], apps=list(range(n))) for n in (0, 1, 30, 300)] * 10
+        encoded = pb.deviceapps_encode(deviceapps)
+        sizes = [len(pb.deviceapps_encode([d])) for d in deviceapps]
+        pb.reset_stats()
+        bytes_written = pb.deviceapps_xwrite_pb(deviceapps, TEST_FILE)
+        stats = pb.stats()
+        self.assertEqual(stats["packed"]["records"], len(deviceapps))
+        self.assertEqual(stats["packed"]["bytes"], bytes_written)
+        self.assertEqual(stats["packed"]["max_size"], max(sizes))
+        self.assertEqual(stats["packed"]["sizes"][max(sizes).bit_length()], 10)
+        self.assertEqual(sum(stats["packed"]["sizes"]), len(deviceapps))
+        self.assertEqual(stats["bytes_written"], os.path.getsize(TEST_FILE))
+        self.assertEqual(stats["stages"]["pack"]["calls"], len(deviceapps))
+        self.assertGreater(stats["stages"]["pack"]["ns"], 0)
+        self.assertGreater(stats["stages"]["write"]["calls"], 0)
+        self.assertEqual(stats["parsed"]["records"], 0)
+
+        pb.reset_stats()
+        self.assertEqual(list(pb.deviceapps_xread_pb(TEST_FILE)), deviceapps)
+        stats = pb.stats()
+        self.assertEqual(stats["packed"]["records"], 0)
+        self.assertEqual((stats["parsed"]["records"], stats["parsed"]["bytes"]), (len(deviceapps), len(encoded)))
+        self.assertEqual(stats["built"], len(deviceapps))
+        self.assertEqual(stats["bytes_read"], os.path.getsize(TEST_FILE))
+        for stage in ("read", "parse", "build"):
+            self.assertGreater(stats["stages"][stage]["calls"], 0, stage)
+
+        for codec in pb.codecs:
+            pb.deviceapps_xwrite_pb(deviceapps, TEST_FILE, codec=codec, threads=2, block_size=4096)
+            pb.reset_stats()
+            columns = pb.deviceapps_xread_columns(TEST_FILE, threads=2)
+            stats = pb.stats()
+            self.assertEqual((stats["parsed"]["records"], stats["built"]), (len(deviceapps),) * 2, codec)
+            self.assertEqual(stats["bytes_read"], os.path.getsize(TEST_FILE), codec)
+            pb.reset_stats()
+            pb.deviceapps_xwrite_columns(TEST_FILE, codec=codec, threads=2, block_size=4096, **columns)
+            stats = pb.stats()
+            self.assertEqual(stats["packed"]["bytes"], len(encoded), codec)
+            self.assertEqual(stats["bytes_written"], os.path.getsize(TEST_FILE), codec)
+            if codec != "none":
+                self.assertGreater(stats["stages"]["compress"]["calls"], 0, codec)
+
+    def test_write_sharded(self):
+        template = TEST_FILE + ".{}"
+        names = [template.format(i) for i in range(4)]
+        def cleanup():
+            for name in names + [name + ".idx" for name in names]:
+                if os.path.exists(name):
+                    os.remove(name)
+        self.addCleanup(cleanup)
+        deviceapps = [{"device": {"type": "gaid", "id": "%032x" % i}, "lat": i, "lon": -i, "apps": list(range(i % 7))}
+                      for i in range(1000)]
+        deviceapps += self.deviceapps + [{"apps": [1]}, {"device": {"type": "idfa"}, "apps": []}]
+        items = deviceapps[:500] + [None, "skipped"] + deviceapps[500:]
+
+        counts = pb.deviceapps_xwrite_sharded(items, template, 4)
+        shards = [[d for d in deviceapps if pb.crc32c(d.get("device", {}).get("id", "").encode()) % 4 == i]
+                  for i in range(4)]
+        self.assertEqual(counts, [(len(shard), len(pb.deviceapps_encode(shard))) for shard in shards])
+        self.assertTrue(all(shard for shard in shards))
+        for name, shard in zip(names, shards):
+            self.assertEqual(list(pb.deviceapps_xread_pb(name)), shard)
+            with gzip.open(name) as f:
+                self.assertEqual(f.read(), pb.deviceapps_encode(shard))
+        # a device is always in the same shard, whatever else is written
+        counts = pb.deviceapps_xwrite_sharded(deviceapps[::-1], template, 4)
+        self.assertEqual([list(pb.deviceapps_xread_pb(name)) for name in names], [shard[::-1] for shard in shards])
+
+        for codec in pb.codecs:
+            counts = pb.deviceapps_xwrite_sharded(iter(deviceapps), template, 3, by="round-robin", codec=codec,
+                                                  packed=True, checksum=True, threads=2, block_size=1000)
+            self.assertEqual([count for count, _ in counts], [len(deviceapps[i::3]) for i in range(3)], codec)
+            for i in range(3):
+                self.assertEqual(list(pb.deviceapps_xread_pb(names[i])), deviceapps[i::3], codec)
+        pb.deviceapps_xwrite_sharded(deviceapps, template, 2, index=True)
+        self.assertTrue(os.path.exists(names[1] + ".idx"))
+        self.assertEqual(list(pb.deviceapps_xread_pb(names[1], start=5, stop=10)),
+                         list(pb.deviceapps_xread_pb(names[1]))[5:10])
+        self.assertEqual(pb.deviceapps_xwrite_sharded([], template, 2), [(0, 0), (0, 0)])
+
+        for kwargs in ({"shards": 0}, {"shards": 2, "by": "device.type"}, {"shards": 2, "codec": "nope"}):
+            with self.assertRaises(ValueError, msg=kwargs):
+                pb.deviceapps_xwrite_sharded(deviceapps, template, **kwargs)
+        with self.assertRaises(ValueError):
+            pb.deviceapps_xwrite_sharded(deviceapps, TEST_FILE, 2)  # the same file for every shard
+        with self.assertRaises(TypeError):
+            pb.deviceapps_xwrite_sharded(deviceapps + [{"device": {"id": 1}}], template, 2)
+        with self.assertRaises(TypeError):
+            pb.deviceapps_xwrite_sharded(1, template, 2)
+        def failing():
+            yield deviceapps[0]
+            raise KeyError("iterator")
+        with self.assertRaises(KeyError):
+            pb.deviceapps_xwrite_sharded(failing(), template, 2)